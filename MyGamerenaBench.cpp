@@ -0,0 +1,669 @@
+﻿#define GAMERENA_NO_MAIN
+#include "MyGamerenaCore.cpp"
+#include <iomanip>
+
+// 基准测试集, 结果以 JSON 输出到标准输出, 便于在版本之间比较.
+// 用法: MyGamerenaBench [--filter <子串>] [--min-time <秒>]
+
+// 防止被测结果被优化掉
+volatile uint64_t BenchSink;
+
+// 统计全局堆分配次数(不含内存池内部的分配). 单个与数组形式的 new/delete
+// 一并替换, 且都不内联: 内联到调用处后编译器会把 free 与 new 的配对视为
+// 不匹配(-Wmismatched-new-delete)
+#ifdef _MSC_VER
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+uint64_t HeapAllocations = 0;
+
+BENCH_NOINLINE void* operator new(size_t size)
+{
+	++HeapAllocations;
+	if (void* p = malloc(size ? size : 1))
+		return p;
+	throw bad_alloc();
+}
+BENCH_NOINLINE void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+BENCH_NOINLINE void operator delete(void* p)noexcept
+{
+	free(p);
+}
+BENCH_NOINLINE void operator delete[](void* p)noexcept
+{
+	free(p);
+}
+BENCH_NOINLINE void operator delete(void* p, size_t)noexcept
+{
+	free(p);
+}
+BENCH_NOINLINE void operator delete[](void* p, size_t)noexcept
+{
+	free(p);
+}
+
+struct BenchResult
+{
+	string Name;
+	List<pair<string, double>> Params;
+	uint64_t Iterations;
+	double NsPerOp;
+	List<pair<string, double>> Counters;
+};
+
+class BenchRunner
+{
+public:
+	BenchRunner(const string& filter, double minTime) :
+		Filter(filter), MinTime(minTime) {}
+	bool Enabled(const string& name)const
+	{
+		return name.find(Filter) != string::npos;
+	}
+	// body(iterations) 执行指定次数的操作并返回耗时(纳秒); 按上一轮的耗时放大
+	// 迭代次数, 直到总耗时超过 MinTime
+	BenchResult& Run(const string& name, List<pair<string, double>> params,
+		const Delegate<double(uint64_t)>& body, uint64_t maxIterations = ~0ull)
+	{
+		uint64_t iterations = 1;
+		double elapsed = body(iterations);
+		while (elapsed < MinTime * 1e9 && iterations < maxIterations)
+		{
+			double scale = elapsed > 0 ? MinTime * 1e9 / elapsed * 1.2 : 10;
+			iterations = (uint64_t)min<double>(max(scale, 2.0) * iterations,
+				(double)maxIterations);
+			elapsed = body(iterations);
+		}
+		Results.push_back({ name, params, iterations, elapsed / iterations, {} });
+		return Results.back();
+	}
+	void Print(ostream& out)const
+	{
+		auto PrintPairs = [&](const List<pair<string, double>>& pairs) {
+			out << '{';
+			for (size_t i = 0; i < pairs.size(); ++i)
+				out << (i ? ", " : "") << '"' << pairs[i].first << "\": "
+					<< setprecision(15) << pairs[i].second;
+			out << '}';
+		};
+		out << "{\n  \"benchmarks\": [";
+		for (size_t i = 0; i < Results.size(); ++i)
+		{
+			const BenchResult& r = Results[i];
+			out << (i ? "," : "") << "\n    {\"name\": \"" << r.Name
+				<< "\", \"params\": ";
+			PrintPairs(r.Params);
+			out << ", \"iterations\": " << r.Iterations
+				<< ", \"ns_per_op\": " << setprecision(6) << r.NsPerOp << ", \"counters\": ";
+			PrintPairs(r.Counters);
+			out << '}';
+		}
+		out << "\n  ]\n}\n";
+	}
+private:
+	string Filter;
+	double MinTime;
+	List<BenchResult> Results;
+};
+
+template <class Func>
+double TimeNs(Func&& func)
+{
+	auto begin = chrono::steady_clock::now();
+	func();
+	auto end = chrono::steady_clock::now();
+	return chrono::duration<double, nano>(end - begin).count();
+}
+
+Roster MakeRoster(int size, int groups)
+{
+	Roster roster;
+	for (int i = 0; i < size; ++i)
+		roster.emplace_back("g" + to_string(i % groups), "p" + to_string(i));
+	return roster;
+}
+
+// 不带行动的实体, 用于单独测量调度和选择目标的开销
+List<Container<Entity>> MakeEntities(int n, int groups)
+{
+	List<Container<Entity>> entities;
+	for (int i = 0; i < n; ++i)
+	{
+		GamerenaAttribute attr("g" + to_string(i % groups), "p" + to_string(i));
+		auto entity = Container<Entity>(new Entity(&attr, nullptr));
+		GetGamerenaState(*entity)->Id = i;
+		entities.push_back(entity);
+	}
+	return entities;
+}
+
+// 改写属性的修饰器: 与加法的 GamerenaModifier 不同, 它参与生成修饰后的
+// 属性, 用于测量复制并修饰属性(以及缓存)的开销
+struct AttackModifier : public EntityAttributeModifier
+{
+	explicit AttackModifier(int attack, const string& name = "") : Attack(attack)
+	{
+		SetName(name);
+	}
+	virtual AttackModifier* Clone()const
+	{
+		return new AttackModifier(*this);
+	}
+	virtual void Modify(IAttribute* attribute)const
+	{
+		static_cast<GamerenaAttribute*>(attribute)->BaseAttack += Attack;
+	}
+	int Attack;
+};
+
+// 调度队列: n 个实体反复以 (80, 151] 的等待时间行动, 每 64 次行动移除一个
+// 实体并把它重新加入, 模拟死亡与补位. checksum 用于确认各实现给出相同的
+// 调度序列.
+double BenchDispatchQueue(IDispatchQueue& queue, int n, uint64_t ops,
+	uint64_t& checksum)
+{
+	RandomEngine rng(n);
+	for (int i = 0; i < n; ++i)
+		queue.Push(i, rng.Random(152));
+	checksum = 0;
+	return TimeNs([&]() {
+		for (uint64_t i = 0; i < ops; ++i)
+		{
+			int id, time;
+			queue.Pop(id, time);
+			checksum = checksum * 31 + id;
+			queue.Push(id, time + rng.Random(80, 152));
+			if ((i & 63) == 0)
+			{
+				int victim = rng.Random(n);
+				queue.Remove(victim);
+				queue.Push(victim, time + rng.Random(80, 152));
+			}
+		}
+	});
+}
+
+void BenchDispatchQueues(BenchRunner& runner)
+{
+	if (!runner.Enabled("dispatch_queue")) return;
+	for (int n : { 1000, 100000, 1000000 })
+	{
+		uint64_t heapChecksum = 0, wheelChecksum = 0;
+		runner.Run("dispatch_queue/heap", { { "entities", n } },
+			[&](uint64_t ops) {
+				HeapDispatchQueue queue;
+				return BenchDispatchQueue(queue, n, ops, heapChecksum);
+			});
+		auto& wheel = runner.Run("dispatch_queue/wheel", { { "entities", n } },
+			[&](uint64_t ops) {
+				TimingWheelDispatchQueue queue;
+				return BenchDispatchQueue(queue, n, ops, wheelChecksum);
+			});
+		// 两次测量的迭代次数可能不同, 用相同的次数重新核对
+		HeapDispatchQueue heap;
+		BenchDispatchQueue(heap, n, wheel.Iterations, heapChecksum);
+		wheel.Counters.emplace_back("matches_heap", heapChecksum == wheelChecksum);
+	}
+}
+
+void BenchDispatchNext(BenchRunner& runner)
+{
+	if (!runner.Enabled("dispatcher/dispatch_next")) return;
+	for (int n : { 100, 10000, 100000 })
+	{
+		auto entities = MakeEntities(n, 4);
+		runner.Run("dispatcher/dispatch_next", { { "entities", n } },
+			[&](uint64_t ops) {
+				RandomEngine rng(1);
+				Dispatcher dispatcher;
+				dispatcher.SetRandomEngine(&rng);
+				for (auto& entity : entities)
+					dispatcher.AddEntity(entity);
+				return TimeNs([&]() {
+					for (uint64_t i = 0; i < ops; ++i)
+						dispatcher.DispatchNext();
+				});
+			});
+	}
+}
+
+void BenchModifiedAttribute(BenchRunner& runner)
+{
+	for (int count : { 0, 5, 50 })
+	{
+		GamerenaAttribute attr("g", "p");
+		Entity entity(&attr, nullptr);
+		for (int i = 0; i < count; ++i)
+		{
+			AttackModifier modifier(i);
+			entity.AddModifier(&modifier);
+		}
+		if (runner.Enabled("entity/modified_attribute/cached"))
+			runner.Run("entity/modified_attribute/cached", { { "modifiers", count } },
+				[&](uint64_t ops) {
+					return TimeNs([&]() {
+						for (uint64_t i = 0; i < ops; ++i)
+							BenchSink += (uintptr_t)entity.GetModifiedAttribute();
+					});
+				});
+		// 每次读取前增删一个修改器, 迫使缓存重建
+		if (runner.Enabled("entity/modified_attribute/rebuild"))
+			runner.Run("entity/modified_attribute/rebuild", { { "modifiers", count } },
+				[&](uint64_t ops) {
+					AttackModifier extra(1, "extra");
+					return TimeNs([&]() {
+						for (uint64_t i = 0; i < ops; ++i)
+						{
+							entity.AddModifier(&extra);
+							BenchSink += (uintptr_t)entity.GetModifiedAttribute();
+							entity.RemoveModifier("extra");
+						}
+					});
+				});
+	}
+}
+
+// 加法修饰器只累加到状态中, 读取属性的开销与修饰器个数无关
+void BenchModifiedStats(BenchRunner& runner)
+{
+	for (int count : { 0, 1, 1000 })
+	{
+		GamerenaAttribute attr("g", "p");
+		Entity entity(&attr, nullptr);
+		for (int i = 0; i < count; ++i)
+		{
+			GamerenaModifier modifier;
+			modifier.AttackModifier = i & 7;
+			entity.AddModifier(&modifier);
+		}
+		if (runner.Enabled("entity/stats/read"))
+			runner.Run("entity/stats/read", { { "modifiers", count } },
+				[&](uint64_t ops) {
+					return TimeNs([&]() {
+						for (uint64_t i = 0; i < ops; ++i)
+							BenchSink += GetGamerenaStats(entity).BaseAttack;
+					});
+				});
+		// 每次读取前加上一个修饰器, 读取后移除
+		if (runner.Enabled("entity/stats/update"))
+			runner.Run("entity/stats/update", { { "modifiers", count } },
+				[&](uint64_t ops) {
+					GamerenaModifier extra;
+					extra.SpeedModifier = 10;
+					return TimeNs([&]() {
+						for (uint64_t i = 0; i < ops; ++i)
+						{
+							size_t id = entity.AddModifier(&extra);
+							BenchSink += GetGamerenaStats(entity).BaseSpeed;
+							entity.RemoveModifier(id);
+						}
+					});
+				});
+	}
+}
+
+void BenchRandomSkill(BenchRunner& runner)
+{
+	if (!runner.Enabled("skill_selector/random_skill")) return;
+	GamerenaAttribute attr("g", "p");
+	runner.Run("skill_selector/random_skill",
+		{ { "skills", attr.tSkillSelector.GetSkillCount() } },
+		[&](uint64_t ops) {
+			RandomEngine rng(1);
+			return TimeNs([&]() {
+				for (uint64_t i = 0; i < ops; ++i)
+					BenchSink += attr.tSkillSelector.RandomSkill(rng).Priority;
+			});
+		});
+}
+
+void BenchRandomTarget(BenchRunner& runner)
+{
+	if (!runner.Enabled("target_selector/random_target")) return;
+	for (int groups : { 2, 16, 256 })
+	{
+		const int n = 10000;
+		auto entities = MakeEntities(n, groups);
+		runner.Run("target_selector/random_target",
+			{ { "entities", n }, { "groups", groups } },
+			[&](uint64_t ops) {
+				RandomEngine rng(1);
+				TargetSelector selector;
+				selector.SetRandomEngine(&rng);
+				for (auto& entity : entities)
+					selector.AddEntity(entity);
+				return TimeNs([&]() {
+					for (uint64_t i = 0; i < ops; ++i)
+						BenchSink += (uintptr_t)selector.GetRandomTarget(
+							entities[i % n].get());
+				});
+			});
+	}
+}
+
+// 范围伤害的批量计算; simd 为 0 时是逐个目标的标量版本. ns_per_op 为每个目标.
+void BenchAreaDamage(BenchRunner& runner)
+{
+	if (!runner.Enabled("skill/area_damage")) return;
+	for (int n : { 16, 1000, 10000 })
+	{
+		RandomEngine rng(1);
+		GamerenaStats attacker = { 300, 60, 60, 80, 60, 60, 70, 90 };
+		List<int> accuracy(n), magicDefense(n), damage(n);
+		List<double> rolls(3 * n);
+		for (int i = 0; i < n; ++i)
+		{
+			accuracy[i] = rng.Random(30, 100);
+			magicDefense[i] = rng.Random(30, 100);
+		}
+		rng.Fill(rolls.data(), rolls.size());
+		for (int simd : { 0, 1 })
+			runner.Run("skill/area_damage", { { "targets", n }, { "simd", simd } },
+				[&](uint64_t ops) {
+					uint64_t batches = (ops + n - 1) / n;
+					double elapsed = TimeNs([&]() {
+						for (uint64_t i = 0; i < batches; ++i)
+						{
+							if (simd)
+								RollAreaMagicDamage(attacker, accuracy.data(),
+									magicDefense.data(), rolls.data(), n, 0.35, damage.data());
+							else
+								RollAreaMagicDamageScalar(attacker, accuracy.data(),
+									magicDefense.data(), rolls.data(), n, 0.35, damage.data());
+							BenchSink += damage[i % n];
+						}
+					});
+					return elapsed * ops / (batches * n);
+				});
+	}
+}
+
+void BenchAttributeConstruction(BenchRunner& runner)
+{
+	if (!runner.Enabled("attribute/construct")) return;
+	List<string> names;
+	for (int i = 0; i < 4096; ++i)
+		names.push_back("p" + to_string(i));
+	runner.Run("attribute/construct", {},
+		[&](uint64_t ops) {
+			return TimeNs([&]() {
+				for (uint64_t i = 0; i < ops; ++i)
+				{
+					GamerenaAttribute attr("g", names[i & 4095]);
+					BenchSink += attr.BaseHP;
+				}
+			});
+		});
+}
+
+void BenchGameStart(BenchRunner& runner)
+{
+	if (!runner.Enabled("game/start")) return;
+	for (int size : { 10, 100, 1000, 10000 })
+		for (int groups : { 2, 10 })
+		{
+			Roster roster = MakeRoster(size, groups);
+			uint64_t endTimes = 0, steps = 0, heapAllocations = 0, poolAllocations = 0;
+			uint64_t setupHeapAllocations = 0;
+			auto& result = runner.Run("game/start",
+				{ { "entities", size }, { "groups", groups } },
+				[&](uint64_t games) {
+					endTimes = steps = heapAllocations = poolAllocations = 0;
+					setupHeapAllocations = 0;
+					double elapsed = 0;
+					for (uint64_t n = 0; n < games; ++n)
+					{
+						uint64_t heap = HeapAllocations;
+						Game game(n);
+						for (auto& entry : roster)
+							game.AddName(entry.first, entry.second);
+						setupHeapAllocations += HeapAllocations - heap;
+						heap = HeapAllocations;
+						uint64_t pool = GetAllocationCounters().Allocations;
+						// 只计入战斗本身, 不含建立名单
+						elapsed += TimeNs([&]() {
+							while (game.Step())
+								++steps;
+						});
+						heapAllocations += HeapAllocations - heap;
+						poolAllocations += GetAllocationCounters().Allocations - pool;
+						endTimes += game.GetCurrentTime();
+					}
+					return elapsed;
+				});
+			result.Counters.emplace_back("mean_end_time",
+				(double)endTimes / result.Iterations);
+			result.Counters.emplace_back("heap_allocs_per_entity_setup",
+				(double)setupHeapAllocations / result.Iterations / size);
+			result.Counters.emplace_back("heap_allocs_per_dispatch",
+				(double)heapAllocations / steps);
+			result.Counters.emplace_back("pool_allocs_per_dispatch",
+				(double)poolAllocations / steps);
+		}
+}
+
+// 加入已生成的属性: 复制一份或与名单共享. 共享时实体只分配自己的状态
+void BenchGameSetup(BenchRunner& runner)
+{
+	if (!runner.Enabled("game/setup")) return;
+	const int Size = 10000;
+	Roster roster = MakeRoster(Size, 10);
+	auto attributes = BuildAttributes(roster);
+	for (int shared : { 0, 1 })
+	{
+		size_t poolBytes = 0;
+		auto& result = runner.Run("game/setup", { { "shared", shared } },
+			[&](uint64_t games) {
+				double elapsed = 0;
+				for (uint64_t n = 0; n < games; ++n)
+				{
+					Game game(n);
+					elapsed += TimeNs([&]() {
+						for (auto& attr : attributes)
+						{
+							if (shared) game.AddAttribute(attr);
+							else game.AddAttribute(*attr);
+						}
+					});
+					poolBytes = game.GetMemoryPool()->GetChunkBytes();
+				}
+				return elapsed;
+			}, 20);
+		result.Counters.emplace_back("pool_bytes_per_entity", (double)poolBytes / Size);
+	}
+}
+
+// 同一时刻的行动一起结算; threads 为 1 时是串行的参照实现
+void BenchGameTick(BenchRunner& runner)
+{
+	if (!runner.Enabled("game/tick")) return;
+	for (int size : { 1000, 10000, 100000 })
+	{
+		Roster roster = MakeRoster(size, 10);
+		auto attributes = BuildAttributes(roster);
+		for (int threads : { 1, 2, 4 })
+		{
+			uint64_t conflicts = 0;
+			auto& result = runner.Run("game/tick",
+				{ { "entities", size }, { "threads", threads } },
+				[&](uint64_t games) {
+					conflicts = 0;
+					double elapsed = 0;
+					for (uint64_t n = 0; n < games; ++n)
+					{
+						Game game(n);
+						game.SetTickThreads(threads);
+						for (auto& attr : attributes)
+							game.AddAttribute(attr);
+						elapsed += TimeNs([&]() { game.Start(); });
+						conflicts += game.GetTickConflicts();
+					}
+					return elapsed;
+				}, 20);
+			result.Counters.emplace_back("conflicts_per_game",
+				(double)conflicts / result.Iterations);
+		}
+	}
+}
+
+// 从对局中途的同一局面反复恢复
+void BenchGameRestore(BenchRunner& runner)
+{
+	if (!runner.Enabled("game/restore")) return;
+	for (int size : { 40, 1000, 10000 })
+	{
+		Roster roster = MakeRoster(size, 4);
+		Game game(1);
+		for (auto& entry : roster)
+			game.AddName(entry.first, entry.second);
+		for (int i = 0; i < size; ++i)
+			game.Step();
+		GameSnapshot snapshot = game.Snapshot();
+		auto& result = runner.Run("game/restore", { { "entities", size } },
+			[&](uint64_t ops) {
+				return TimeNs([&]() {
+					for (uint64_t i = 0; i < ops; ++i)
+						game.Restore(snapshot);
+				});
+			});
+		result.Counters.emplace_back("snapshot_bytes", snapshot.Data.size());
+	}
+}
+
+// 事件总线: 无订阅者, 逐个投递与分批投递所有事件
+void BenchGameEvents(BenchRunner& runner)
+{
+	if (!runner.Enabled("game/events")) return;
+	Roster roster = MakeRoster(1000, 4);
+	auto attributes = BuildAttributes(roster);
+	for (int batch : { 0, 1, 256 })
+	{
+		Game game(0);
+		for (auto& attr : attributes)
+			game.AddAttribute(attr);
+		uint64_t events = 0;
+		if (batch > 0)
+			game.GetEventBus().Subscribe(EventBus::AllTypes,
+				[&](const BattleEvent* e, size_t count) {
+					events += count;
+					BenchSink += e[count - 1].Value;
+				}, batch);
+		auto& result = runner.Run("game/events", { { "batch", batch } },
+			[&](uint64_t games) {
+				events = 0;
+				return TimeNs([&]() {
+					for (uint64_t n = 0; n < games; ++n)
+					{
+						game.Reset(n);
+						game.Start();
+					}
+				});
+			});
+		result.Counters.emplace_back("events_per_game",
+			(double)events / result.Iterations);
+	}
+}
+
+// 每局重新建立对局与 Reset 后重赛; Reset 不应分配堆内存
+void BenchGameRematch(BenchRunner& runner)
+{
+	if (!runner.Enabled("game/rematch")) return;
+	for (int size : { 40, 1000 })
+	{
+		Roster roster = MakeRoster(size, 4);
+		auto attributes = BuildAttributes(roster);
+		for (int reuse : { 0, 1 })
+		{
+			Game game(0);
+			for (auto& attr : attributes)
+				game.AddAttribute(attr);
+			uint64_t setupHeapAllocations = 0;
+			auto& result = runner.Run("game/rematch",
+				{ { "entities", size }, { "reuse", reuse } },
+				[&](uint64_t games) {
+					setupHeapAllocations = 0;
+					return TimeNs([&]() {
+						for (uint64_t n = 0; n < games; ++n)
+						{
+							uint64_t heap = HeapAllocations;
+							if (reuse)
+							{
+								game.Reset(n);
+								setupHeapAllocations += HeapAllocations - heap;
+								game.Start();
+								continue;
+							}
+							Game fresh(n);
+							for (auto& attr : attributes)
+								fresh.AddAttribute(attr);
+							setupHeapAllocations += HeapAllocations - heap;
+							fresh.Start();
+						}
+					});
+				});
+			result.Counters.emplace_back("heap_allocs_per_setup",
+				(double)setupHeapAllocations / result.Iterations);
+		}
+	}
+}
+
+// WinEstimator 的吞吐: 每个线程复用一个 Game, 每局由 Game::Reset 重新开始
+void BenchWinEstimate(BenchRunner& runner)
+{
+	if (!runner.Enabled("estimate/games")) return;
+	for (int size : { 40, 1000 })
+	{
+		Roster roster = MakeRoster(size, 4);
+		WinEstimator estimator(roster, BuildAttributes(roster), 1);
+		runner.Run("estimate/games", { { "entities", size } },
+			[&](uint64_t games) {
+				WinEstimator::Options options;
+				options.MinGames = options.MaxGames = games;
+				options.Threads = 1;
+				return TimeNs([&]() {
+					BenchSink += estimator.Estimate(options).Draws;
+				});
+			});
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	string filter;
+	double minTime = 0.2;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		if (option == "--filter")
+			filter = argv[i + 1];
+		else if (option == "--min-time")
+			minTime = atof(argv[i + 1]);
+		else
+		{
+			cerr << "Usage: " << argv[0]
+				 << " [--filter <substring>] [--min-time <seconds>]\n";
+			return 1;
+		}
+	}
+	BenchRunner runner(filter, minTime);
+	BenchDispatchQueues(runner);
+	BenchDispatchNext(runner);
+	BenchModifiedAttribute(runner);
+	BenchModifiedStats(runner);
+	BenchRandomSkill(runner);
+	BenchRandomTarget(runner);
+	BenchAreaDamage(runner);
+	BenchAttributeConstruction(runner);
+	BenchGameSetup(runner);
+	BenchGameStart(runner);
+	BenchGameTick(runner);
+	BenchGameRestore(runner);
+	BenchGameRematch(runner);
+	BenchWinEstimate(runner);
+	BenchGameEvents(runner);
+	runner.Print(cout);
+}
@@ -3,23 +3,105 @@
 #include <iostream>
 #include <ctime>
 #include <unordered_set>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <climits>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cerrno>
+#include <type_traits>
+#include <fstream>
+#include <iterator>
+#include <deque>
+#include <typeinfo>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define GAMERENA_SSE2
+#endif
 using namespace GameCore;
 using namespace std;
 
-inline double Random()
+// 基于计数器的随机数发生器: 第 n 个输出只由 (Key, n) 决定, 因此可以 O(1)
+// 跳过(Discard)或派生互不相关的子序列(Split). 每个 Game 持有一个, 相同的
+// 种子总是得到完全相同的对局.
+class RandomEngine
 {
-	const int RandMax = RAND_MAX + 1;
-	return ((double)rand()) / RandMax;
-}
-inline int Random(int n)
-{
-	return Random() * n;
-}
-inline int Random(int l, int r)
-{
-	if (l >= r) throw InvalidArgumentException("Condition: l < r.");
-	return Random(r - l) + l;
-}
+public:
+	explicit RandomEngine(uint64_t seed = 0)
+	{
+		SetSeed(seed);
+	}
+	void SetSeed(uint64_t seed)
+	{
+		Seed = seed;
+		Key = Mix(seed);
+		Counter = 0;
+	}
+	uint64_t GetSeed()const { return Seed; }
+	uint64_t GetCounter()const { return Counter; }
+	void SetCounter(uint64_t counter) { Counter = counter; }
+	void Discard(uint64_t n) { Counter += n; }
+	uint64_t Next()
+	{
+		return Mix(Key + ++Counter * Gamma);
+	}
+	double Random()
+	{
+		return ToDouble(Next());
+	}
+	int Random(int n)
+	{
+		return Random() * n;
+	}
+	int Random(int l, int r)
+	{
+		if (l >= r) throw InvalidArgumentException("Condition: l < r.");
+		return Random(r - l) + l;
+	}
+	// 批量生成 [0, 1) 内的随机数, 与连续调用 n 次 Random() 结果相同
+	void Fill(double* out, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+			out[i] = ToDouble(Mix(Key + (Counter + i + 1) * Gamma));
+		Counter += n;
+	}
+	// 派生出一条与本序列及其他 stream 互不相关的子序列
+	RandomEngine Split(uint64_t stream)const
+	{
+		RandomEngine result;
+		result.Seed = Seed;
+		result.Key = Mix(Key ^ Mix(stream + Gamma));
+		return result;
+	}
+private:
+	static const uint64_t Gamma = 0x9E3779B97F4A7C15ull;
+	static uint64_t Mix(uint64_t z)
+	{ // SplitMix64
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+	static double ToDouble(uint64_t x)
+	{
+		return (x >> 11) * (1.0 / 9007199254740992.0);
+	}
+	uint64_t Seed;
+	uint64_t Key;
+	uint64_t Counter;
+};
 
 namespace {
 using Stage = int;
@@ -37,11 +119,17 @@ struct TargetEnum
 	const Target Teammate = 1 << 0;
 	const Target Enemy = 1 << 1;
 	const Target Random = 1 << 2;
+	const Target EnemyGroup = 1 << 3; // 随机一个敌方组的全部存活者
 };
 constexpr StageEnum Stages;
 constexpr TargetEnum Targets;
 }
 
+// 加法修饰器. 不参与生成修饰后的属性, 而是由持有者的状态累加到
+// GamerenaState::ModifierDelta 中(加入与移除都是 O(1)), 读取属性时加上
+// 总和后统一截断一次(见 ApplyModifierDelta), 读取的开销与修饰器个数无关.
+// 因此 Modify 与 ModifiesAttribute 都是 final: 子类改写的 Modify 不会被
+// 调用. 需要按自己的规则改写属性的修饰器应直接继承 EntityAttributeModifier.
 struct GamerenaModifier : public EntityAttributeModifier
 {
 	virtual GamerenaModifier* Clone()const
@@ -49,7 +137,8 @@ struct GamerenaModifier : public EntityAttributeModifier
 		return new GamerenaModifier(*this);
 	}
 	virtual void ModifyState(IState* state)const;
-	virtual void Modify(IAttribute* attribute)const;
+	virtual void Modify(IAttribute* attribute)const final;
+	virtual bool ModifiesAttribute()const final { return false; }
 	int HPModifier = 0;
 	int AttackModifier = 0;
 	int DefenseModifier = 0;
@@ -61,72 +150,316 @@ struct GamerenaModifier : public EntityAttributeModifier
 };
 
 class GamerenaAttribute;
+class Game;
+struct GamerenaState;
+void NotifyDeath(Game& game, const GamerenaState& state);
+
+// 内置技能. 每个技能由 SkillDescriptor<Id> 描述, 调用时经 switch 直接分派
+// 到具体函数, 编译器可以内联; 只有脚本技能(Scripted)才经过 std::function.
+enum class SkillId : uint8_t
+{
+	BaseAttack,
+	BaseMagic,
+	FireBall,
+	Critical,
+	Cuel,
+	Meteor,
+	Scripted
+};
+
+// 内置技能的效果, 供同一时刻并行结算时预先掷骰(见 Game::SetTickThreads)
+enum class SkillEffect : uint8_t
+{
+	PhysicDamage,
+	MagicDamage,
+	Heal,
+	AreaMagicDamage
+};
+
+void BaseAttack(Game& game, Entity* p, Entity* t);
+void BaseMagic(Game& game, Entity* p, Entity* t);
+void FireBall(Game& game, Entity* p, Entity* t);
+void Critical(Game& game, Entity* p, Entity* t);
+void Cuel(Game& game, Entity* p, Entity* t);
+void Meteor(Game& game, Entity* p, Entity* t);
+
+template <SkillId Id>
+struct SkillDescriptor;
+#define GAMERENA_SKILL(Name, TargetValue, EffectValue, FactorValue)  \
+	template <>                                                       \
+	struct SkillDescriptor<SkillId::Name>                             \
+	{                                                                 \
+		static constexpr Target TargetType = TargetValue;             \
+		static constexpr SkillEffect Effect = EffectValue;            \
+		static constexpr double Factor = FactorValue;                 \
+		static void Invoke(Game& game, Entity* p, Entity* t)          \
+		{                                                             \
+			Name(game, p, t);                                         \
+		}                                                             \
+	};
+GAMERENA_SKILL(BaseAttack, Targets.Enemy, SkillEffect::PhysicDamage, 1.0)
+GAMERENA_SKILL(BaseMagic, Targets.Enemy, SkillEffect::MagicDamage, 1.0)
+GAMERENA_SKILL(FireBall, Targets.Enemy, SkillEffect::MagicDamage, 1.8)
+GAMERENA_SKILL(Critical, Targets.Enemy, SkillEffect::PhysicDamage, 2.15)
+GAMERENA_SKILL(Cuel, Targets.Teammate, SkillEffect::Heal, 1.2)
+GAMERENA_SKILL(Meteor, Targets.EnemyGroup, SkillEffect::AreaMagicDamage, 0.35)
+#undef GAMERENA_SKILL
 
-using SkillType = Delegate<void(Entity*, Entity*)>;
+using SkillType = Delegate<void(Game&, Entity*, Entity*)>;
 struct SkillInfo
 {
-	SkillType Skill;
+	SkillId Id;
+	uint8_t Script; // Scripted: SkillSelector 中脚本的下标
 	Target TargetType;
 	int Priority;
 };
 
+// 按 Priority 加权随机选择技能. 技能集合或权重改变时重建 Walker/Vose 别名表
+// (O(n), 整数运算, 无误差), 之后每次选择只需一次随机数和一次比较.
+// Priority 不大于 0 的技能不会被选中. 技能与别名表都是定长数组, 复制属性
+// 时无需分配内存.
 class SkillSelector
 {
 public:
-	void AddSkill(const SkillInfo& skill)
+	enum { MaxSkills = 8 };
+	template <SkillId Id>
+	void AddSkill(int priority)
 	{
-		if (!skill.Skill)
+		Push({ Id, 0, SkillDescriptor<Id>::TargetType, priority });
+	}
+	// 由用户脚本实现的技能
+	void AddScriptedSkill(const SkillType& skill, Target targetType, int priority)
+	{
+		if (!skill)
 			throw InvalidArgumentException("skill is invalid.");
-		Skills.push_back(skill);
-		TotalPriority += skill.Priority;
+		if (Scripts.size() > UINT8_MAX)
+			throw InvalidArgumentException("too many scripted skills.");
+		Push({ SkillId::Scripted, (uint8_t)Scripts.size(), targetType, priority });
+		Scripts.push_back(skill);
+	}
+	void SetPriority(size_t index, int priority)
+	{
+		if (index >= Count)
+			throw InvalidArgumentException("index is out of range.");
+		Skills[index].Priority = priority;
+		Rebuild();
+	}
+	size_t GetSkillCount()const { return Count; }
+	const SkillInfo& GetSkill(size_t index)const
+	{
+		if (index >= Count)
+			throw InvalidArgumentException("index is out of range.");
+		return Skills[index];
 	}
 	// TODO:这是最简单的技能选择器; 实际将会根据Int实现多种选择器
-	SkillInfo& RandomSkill()
+	const SkillInfo& RandomSkill(RandomEngine& rng)const
+	{
+		if (TotalPriority <= 0)
+			return Skills[0];
+		uint64_t k = rng.Random() * Count * TotalPriority;
+		size_t i = k / TotalPriority;
+		return Skills[(int64_t)(k % TotalPriority) < Thresholds[i] ? i : Aliases[i]];
+	}
+	inline void Invoke(const SkillInfo& skill, Game& game, Entity* p, Entity* t)const;
+	void GenerateSkill(GamerenaAttribute* e, RandomEngine& rng);
+private:
+	void Push(const SkillInfo& skill)
+	{
+		if (Count >= MaxSkills)
+			throw InvalidArgumentException("too many skills.");
+		Skills[Count++] = skill;
+		Rebuild();
+	}
+	void Rebuild()
 	{
-		int k = Random(TotalPriority);
-		auto iter = Skills.begin();
-		while (k >= iter->Priority)
+		const size_t n = Count;
+		TotalPriority = 0;
+		for (size_t i = 0; i < n; ++i)
+			TotalPriority += max(Skills[i].Priority, 0);
+		uint8_t Small[MaxSkills], Large[MaxSkills];
+		size_t smallCount = 0, largeCount = 0;
+		for (size_t i = 0; i < n; ++i)
+		{ // 权重放大 n 倍后, 每格的容量恰为 TotalPriority
+			Thresholds[i] = (int64_t)max(Skills[i].Priority, 0) * n;
+			Aliases[i] = i;
+			if (Thresholds[i] < TotalPriority) Small[smallCount++] = i;
+			else Large[largeCount++] = i;
+		}
+		while (smallCount && largeCount)
 		{
-			k -= iter->Priority;
-			++iter;
+			int less = Small[--smallCount];
+			int more = Large[largeCount - 1];
+			Aliases[less] = more;
+			Thresholds[more] -= TotalPriority - Thresholds[less];
+			if (Thresholds[more] < TotalPriority)
+			{
+				--largeCount;
+				Small[smallCount++] = more;
+			}
 		}
-		return *iter;
+		while (largeCount) Thresholds[Large[--largeCount]] = TotalPriority;
+		while (smallCount) Thresholds[Small[--smallCount]] = TotalPriority;
+	}
+	size_t Count = 0;
+	int64_t TotalPriority = 0;
+	SkillInfo Skills[MaxSkills];
+	int64_t Thresholds[MaxSkills];
+	uint8_t Aliases[MaxSkills];
+	List<SkillType> Scripts;
+};
+
+// 战斗中实际使用的属性值(已应用修饰器)
+struct GamerenaStats
+{
+	int BaseHP;
+	int BaseAttack;
+	int BaseDefense;
+	int BaseMagic;
+	int BaseMagicDefense;
+	int BaseSpeed;
+	int BaseAccuracy;
+	int BaseIntelligence;
+};
+
+// 可选的列式属性存储: 每项属性一段连续数组, 以 GamerenaState::Id 为下标,
+// 便于对大量实体做线性扫描. 绑定后 GamerenaState 的 HP/Active/Score/
+// NextActionTime 都读写于此, 修饰后的属性在修饰器变化后惰性刷新.
+class StatStore
+{
+public:
+	void Bind(Entity& entity);
+	void MarkDirty(int id) { Dirty[id] = 1; }
+	GamerenaStats GetStats(int id)
+	{
+		if (Dirty[id]) Refresh(id);
+		return { MaxHP[id], Attack[id], Defense[id], Magic[id],
+			MagicDefense[id], Speed[id], Accuracy[id], Intelligence[id] };
+	}
+	size_t Size()const { return HP.size(); }
+	int CountActive()const
+	{
+		int count = 0;
+		for (auto active : Active)
+			count += active;
+		return count;
+	}
+	List<long long> TotalHPByGroup()const
+	{
+		List<long long> result(GroupKeys.size(), 0);
+		for (size_t i = 0; i < HP.size(); ++i)
+			result[Group[i]] += HP[i];
+		return result;
 	}
-	void GenerateSkill(GamerenaAttribute* e);
+	size_t GetGroupCount()const { return GroupKeys.size(); }
+	Symbol GetGroupKey(int group)const { return GroupKeys[group]; }
+	List<int> HP;
+	List<int> MaxHP;
+	List<int> Attack;
+	List<int> Defense;
+	List<int> Magic;
+	List<int> MagicDefense;
+	List<int> Speed;
+	List<int> Accuracy;
+	List<int> Intelligence;
+	List<int> Score;
+	List<int> NextActionTime;
+	List<unsigned char> Active;
+	List<unsigned char> Dirty;
+	List<int> Group;
+	List<Entity*> Entities;
 private:
-	int TotalPriority = 0;
-	List<SkillInfo> Skills;
+	void Refresh(int id);
+	List<int> GroupIndices; // 以组名的 Symbol 为下标, -1 表示未出现
+	List<Symbol> GroupKeys;
 };
 
 struct GamerenaState : public EntityState
 {
 	virtual GamerenaState* Clone()const
 	{
-		return new GamerenaState(*this);
+		auto state = new GamerenaState(*this);
+		state->Detach();
+		state->Owner = nullptr;
+		return state;
+	}
+	// 返回本次伤害是否致死; 已经死亡的实体不会再死一次. 致死时通知所属的
+	// Game 把实体移出调度与目标选择, 脚本技能直接调用本函数也是如此
+	bool GetDamage(int dmg)
+	{
+		SetHP(max(GetHP() - dmg, 0));
+		if (GetHP() > 0 || !IsActive()) return false;
+		SetActive(false);
+		if (Owner) NotifyDeath(*Owner, *this);
+		return true;
+	}
+	int GetHP()const { return Store ? Store->HP[Id] : HP; }
+	void SetHP(int hp) { (Store ? Store->HP[Id] : HP) = hp; }
+	bool IsActive()const { return Store ? Store->Active[Id] != 0 : Active; }
+	void SetActive(bool active)
+	{
+		if (Store) Store->Active[Id] = active;
+		else Active = active;
+	}
+	int GetScore()const { return Store ? Store->Score[Id] : Score; }
+	void SetScore(int score) { (Store ? Store->Score[Id] : Score) = score; }
+	void AddScore(int score) { (Store ? Store->Score[Id] : Score) += score; }
+	int GetNextActionTime()const
+	{
+		return Store ? Store->NextActionTime[Id] : NextActionTime;
+	}
+	void SetNextActionTime(int time)
+	{
+		(Store ? Store->NextActionTime[Id] : NextActionTime) = time;
 	}
-	void GetDamage(int dmg)
+	// 把绑定在 StatStore 中的值取回本对象并解除绑定
+	void Detach()
 	{
-		HP = max(HP - dmg, 0);
-		if (HP == 0) Active = false;
-		for (auto& OnDeathHandler : OnDeath)
-			OnDeathHandler(this);
+		if (Store == nullptr) return;
+		HP = Store->HP[Id];
+		Active = Store->Active[Id] != 0;
+		Score = Store->Score[Id];
+		NextActionTime = Store->NextActionTime[Id];
+		Store = nullptr;
 	}
+	// 只保存随战斗变化的部分; 各项属性由共享的 GamerenaAttribute 与修饰器
+	// 给出(见 GetGamerenaStats)
+	StatStore* Store = nullptr;
+	Game* Owner = nullptr; // 所属的 Game, 由 Game::AddAttribute 设置
+	int Id = -1;
 	Stage Stage = Stages.Waiting;
-	bool Active = true;
 	int NextActionTime = 0;
 	int Score = 0;
-	int GroupIndex;
+	Symbol GroupIndex; // 组名
 	int HP;
-	int Attack;
-	int Defense;
-	int Magic;
-	int MagicDefense;
-	int Speed;
-	int Accuracy;
-	int Intelligence;
-	List<Delegate<void(GamerenaState*)>> OnDeath;
-	//List<Delegate<void(Entity*)>> OnDoAction;
-	//List<Delegate<void(Entity*)>> OnDefense;
+	bool Active = true;
+	GamerenaStats ModifierDelta = {}; // 所有 GamerenaModifier 之和
+protected:
+	virtual void OnModifiersChanged()
+	{
+		if (Store) Store->MarkDirty(Id);
+	}
+	virtual void OnModifierAdded(const IModifier& modifier)
+	{
+		AddModifierDelta(modifier, 1);
+	}
+	virtual void OnModifierRemoved(const IModifier& modifier)
+	{
+		AddModifierDelta(modifier, -1);
+	}
+private:
+	void AddModifierDelta(const IModifier& modifier, int sign)
+	{
+		auto m = dynamic_cast<const GamerenaModifier*>(&modifier);
+		if (m == nullptr || m->ModifiesAttribute()) return;
+		ModifierDelta.BaseHP += sign * m->HPModifier;
+		ModifierDelta.BaseAttack += sign * m->AttackModifier;
+		ModifierDelta.BaseDefense += sign * m->DefenseModifier;
+		ModifierDelta.BaseMagic += sign * m->MagicModifier;
+		ModifierDelta.BaseMagicDefense += sign * m->MagicDefenseModifier;
+		ModifierDelta.BaseSpeed += sign * m->SpeedModifier;
+		ModifierDelta.BaseAccuracy += sign * m->AccuracyModifier;
+		ModifierDelta.BaseIntelligence += sign * m->IntelligenceModifier;
+	}
 };
 
 inline GamerenaState* GetGamerenaState(Entity& e)
@@ -137,6 +470,8 @@ inline const GamerenaState* GetGamerenaState(const Entity& e)
 {
 	return dynamic_cast<const GamerenaState*>(e.GetState());
 }
+GamerenaStats GetGamerenaStats(const Entity& e);
+inline void ResetState(GamerenaState& state, const GamerenaAttribute& attr);
 
 struct GamerenaAttribute : public EntityAttribute
 {
@@ -147,23 +482,19 @@ struct GamerenaAttribute : public EntityAttribute
 	GamerenaAttribute(const string& groupName, const string& name)
 	{
 		SetName(name);
-		OriginGroupIndex = hash<string>()(groupName);
-		const size_t RandomF = 419;
-		const size_t RandomS = 1284541;
-		srand(hash<string>()(name) * RandomF + RandomS);
-		BaseHP = Random(200, 350);
-		BaseAttack = Random(30, 100);
-		BaseDefense = Random(30, 100);
-		BaseMagic = Random(30, 100);
-		BaseMagicDefense = Random(30, 100);
-		BaseSpeed = Random(30, 100);
-		BaseAccuracy = Random(30, 100);
-		BaseIntelligence = Random(30, 100);
-		tSkillSelector.GenerateSkill(this);
+		OriginGroupIndex = SymbolTable::Global().Intern(groupName);
+		Generate();
+	}
+	// 组名与名字已经登记过, 例如由 BuildAttributes 成批登记
+	GamerenaAttribute(Symbol groupName, Symbol name)
+	{
+		SetName(name);
+		OriginGroupIndex = groupName;
+		Generate();
 	}
 	virtual GamerenaState* CreateDefaultState()const;
 	SkillSelector tSkillSelector;
-	size_t OriginGroupIndex;
+	Symbol OriginGroupIndex;
 	int BaseHP;
 	int BaseAttack;
 	int BaseDefense;
@@ -172,6 +503,23 @@ struct GamerenaAttribute : public EntityAttribute
 	int BaseSpeed;
 	int BaseAccuracy;
 	int BaseIntelligence;
+private:
+	// 属性只由名字决定
+	void Generate()
+	{
+		const size_t RandomF = 419;
+		const size_t RandomS = 1284541;
+		RandomEngine rng(hash<string>()(GetName()) * RandomF + RandomS);
+		BaseHP = rng.Random(200, 350);
+		BaseAttack = rng.Random(30, 100);
+		BaseDefense = rng.Random(30, 100);
+		BaseMagic = rng.Random(30, 100);
+		BaseMagicDefense = rng.Random(30, 100);
+		BaseSpeed = rng.Random(30, 100);
+		BaseAccuracy = rng.Random(30, 100);
+		BaseIntelligence = rng.Random(30, 100);
+		tSkillSelector.GenerateSkill(this, rng);
+	}
 };
 
 class UnexceptedCallException : public Exception
@@ -182,534 +530,4363 @@ public:
 	string Message;
 };
 
-class Dispatcher
+// 快照缓冲区的顺序读写. 只接受可以按字节复制的类型, 数组整段 memcpy;
+// 读取数组时复用目标 List 已有的容量, 反复恢复不会分配内存.
+class SnapshotWriter
 {
-	static bool Compare(Container<Entity> lhs, Container<Entity> rhs)
+public:
+	explicit SnapshotWriter(List<char>& data) : Data(data) {}
+	template <class T>
+	void Put(const T& value)
 	{
-		return
-			GetGamerenaState(*lhs)->NextActionTime
-				<
-			GetGamerenaState(*rhs)->NextActionTime;
+		PutArray(&value, 1);
 	}
-	static int SetNextActionTime(Container<Entity> e)
+	template <class T>
+	void PutArray(const T* values, size_t n)
 	{
-		auto modifiedAttr = e->GetModifiedAttribute();
-		GamerenaAttribute& attr =
-			*(GamerenaAttribute*)modifiedAttr.get();
-		const int BaseWaitTime = 160;
-		return
-			BaseWaitTime
-			- attr.BaseSpeed * 0.3
-			- (attr.BaseSpeed >> 1) * Random();
-		// BaseWaitTime(160) - [0.3, 0.8) * Speed[30,100) => WaitTime (80, 151]
+		static_assert(is_trivially_copyable<T>::value,
+			"snapshot values must be trivially copyable.");
+		size_t offset = Data.size();
+		Data.resize(offset + n * sizeof(T));
+		if (n) memcpy(&Data[offset], values, n * sizeof(T));
 	}
-public:
-	void SetListener(const function<void(Dispatcher*, int)>& listener)
+	template <class T>
+	void PutList(const List<T>& values)
 	{
-		Listener = listener;
+		Put(values.size());
+		PutArray(values.data(), values.size());
 	}
-	void AddEntity(Container<Entity> entity)
+private:
+	List<char>& Data;
+};
+
+class SnapshotReader
+{
+public:
+	explicit SnapshotReader(const List<char>& data) : Data(data) {}
+	template <class T>
+	void Get(T& value)
 	{
-		SetNextActionTime(entity);
-		Entities.push_back(entity);
-		push_heap(Entities.begin(), Entities.end(), Compare);
+		GetArray(&value, 1);
 	}
-	void DispatchNext()
+	template <class T>
+	void GetArray(T* values, size_t n)
 	{
-		GamerenaState* state;
-		do
-		{
-			state = GetGamerenaState(*Entities.front());
-			if (!state->Active)
-			{
-				pop_heap(Entities.begin(), Entities.end(), Compare);
-				Entities.pop_back();
-			}
-		} while (!state->Active&& Entities.size() > 1);
-		if (Entities.size() <= 1)
-		{
-			Listener(this, -1);
-			return;
-		}
-		Time = state->NextActionTime;
-		pop_heap(Entities.begin(), Entities.end(), Compare);
-		SetNextActionTime(Entities.back());
-		Entities.back()->DoActions();
-		_LastEntity = Entities.back().get();
-		push_heap(Entities.begin(), Entities.end(), Compare);
-		if (Listener) Listener(this, Time);
+		static_assert(is_trivially_copyable<T>::value,
+			"snapshot values must be trivially copyable.");
+		if (Offset + n * sizeof(T) > Data.size())
+			throw InvalidArgumentException("snapshot is truncated.");
+		if (n) memcpy(values, &Data[Offset], n * sizeof(T));
+		Offset += n * sizeof(T);
 	}
-	Entity* LastEntity()
+	template <class T>
+	void GetList(List<T>& values)
 	{
-		return _LastEntity;
+		size_t n;
+		Get(n);
+		values.resize(n);
+		GetArray(values.data(), n);
 	}
-	int GetCurrentTime()const
+	// 读取并核对一个标记, 用于发现快照与当前对象的结构不一致
+	void Expect(int tag, const char* message)
 	{
-		return Time;
+		int value;
+		Get(value);
+		if (value != tag)
+			throw InvalidArgumentException(message);
 	}
 private:
-	int	Time = 0;
-	function<void(Dispatcher*, int)> Listener;
-	List<Container<Entity>> Entities;
-	Entity* _LastEntity = nullptr;
+	const List<char>& Data;
+	size_t Offset = 0;
 };
 
-class TargetSelector
+// 调度队列: 按 (行动时刻, 入队顺序) 依次取出实体编号, 同一时刻的实体总是
+// 按入队顺序行动, 因此不同的实现给出完全相同的调度序列.
+struct IDispatchQueue
+{
+	IDispatchQueue() = default;
+	virtual ~IDispatchQueue() = default;
+	// 已在队列中的实体会被重新安排. 早于上一次出队时刻的 time 按上一次
+	// 出队的时刻处理(排在该时刻已入队的实体之后), 各实现都是如此
+	virtual void Push(int id, int time) = 0;
+	virtual bool Pop(int& id, int& time) = 0;
+	// 查看下一个出队的实体, 不改变出队顺序
+	virtual bool Peek(int& id, int& time) = 0;
+	virtual void Remove(int id) = 0;
+	virtual bool Contains(int id)const = 0;
+	virtual size_t Size()const = 0;
+	// 清空队列并回到时刻 0, 保留已分配的空间
+	virtual void Clear() = 0;
+	// 只能恢复到同一种实现的队列中
+	virtual void Save(SnapshotWriter& writer)const = 0;
+	virtual void Load(SnapshotReader& reader) = 0;
+};
+
+// 二叉堆实现; 删除是惰性的, 失效的项在出队时跳过
+class HeapDispatchQueue : public IDispatchQueue
 {
+	struct Item
+	{
+		int Time;
+		int Id;
+		uint64_t Seq;
+	};
+	static bool Later(const Item& lhs, const Item& rhs)
+	{
+		if (lhs.Time != rhs.Time) return lhs.Time > rhs.Time;
+		return lhs.Seq > rhs.Seq;
+	}
 public:
-	// TODO: GetRandomTarget()是最简单的实现; 具体选择算法实现将会取决于Int
-	Entity* GetRandomTarget(Entity* entity)
+	virtual void Push(int id, int time)
 	{
-		if (UpdateFlag) Update();
-		auto state = GetGamerenaState(*entity);
-		if (state->GroupIndex == -1)
-		{
-			int select = ActiveGroups[Random(ActiveGroups.size())];
-			return _LastTarget =
-				Entities[select][Random(Entities[select].size())].get();
-		}
-		int nth =
-			find(ActiveGroups.begin(), ActiveGroups.end(), state->GroupIndex)
-		  - ActiveGroups.begin();
-		int select = Random(ActiveGroups.size() - 1);
-		if (select >= nth) ++select;
-		select = ActiveGroups[select];
-		return _LastTarget = Entities[select][Random(Entities[select].size())].get();
+		if (Seqs.size() <= (size_t)id)
+			Seqs.resize(id + 1, 0);
+		if (Seqs[id] == 0) ++Count;
+		Seqs[id] = ++Seq;
+		Items.push_back({ max(time, Now), id, Seq });
+		push_heap(Items.begin(), Items.end(), Later);
 	}
-	Entity* GetRandomTeammate(Entity* entity)
+	virtual bool Pop(int& id, int& time)
 	{
-		if (UpdateFlag) Update();
-		auto state = GetGamerenaState(*entity);
-		if (state->GroupIndex == -1)
+		while (!Items.empty())
 		{
-			int select = ActiveGroups[Random(ActiveGroups.size())];
-			return _LastTarget =
-				Entities[select][Random(Entities[select].size())].get();
+			Item item = Items.front();
+			pop_heap(Items.begin(), Items.end(), Later);
+			Items.pop_back();
+			if (Seqs[item.Id] != item.Seq) continue;
+			Seqs[item.Id] = 0;
+			--Count;
+			id = item.Id;
+			time = Now = item.Time;
+			return true;
 		}
-		int teammateCount = Entities[state->GroupIndex].size();
-		if (teammateCount > 0)
-			return Entities[state->GroupIndex][Random(teammateCount)].get();
-		return entity;
-
+		return false;
 	}
-	void AddEntity(Container<Entity> entity)
+	virtual bool Peek(int& id, int& time)
 	{
-		auto state = GetGamerenaState(*entity);
-		auto attrCopy = entity->GetAttributeCopy();
-		GamerenaAttribute& attr = *(GamerenaAttribute*)attrCopy.get();
-		if (Entities.count(attr.OriginGroupIndex) == 0)
+		while (!Items.empty() && Seqs[Items.front().Id] != Items.front().Seq)
 		{
-			auto iter =lower_bound(
-				ActiveGroups.begin(), ActiveGroups.end(),
-				attr.OriginGroupIndex);
-			ActiveGroups.insert(iter, attr.OriginGroupIndex);
+			pop_heap(Items.begin(), Items.end(), Later);
+			Items.pop_back();
 		}
-		Entities[attr.OriginGroupIndex].push_back(entity);
+		if (Items.empty()) return false;
+		id = Items.front().Id;
+		time = Items.front().Time;
+		return true;
 	}
-	void SetUpdateFlag(bool flag = true)
+	virtual void Remove(int id)
 	{
-		UpdateFlag = flag;
+		if (!Contains(id)) return;
+		Seqs[id] = 0;
+		--Count;
 	}
-	Entity* LastTarget()
+	virtual bool Contains(int id)const
 	{
-		return _LastTarget;
+		return (size_t)id < Seqs.size() && Seqs[id] != 0;
 	}
-	int GroupsKeep()
+	virtual size_t Size()const { return Count; }
+	virtual void Clear()
 	{
-		if (UpdateFlag) Update();
-		return ActiveGroups.size();
+		Seq = 0;
+		Count = 0;
+		Now = 0;
+		fill(Seqs.begin(), Seqs.end(), 0);
+		Items.clear();
 	}
-protected:
-	void Update()
+	virtual void Save(SnapshotWriter& writer)const
 	{
-		UpdateFlag = false;
-		for (auto& pair : Entities)
-		{
-			List<Container<Entity>>& group = pair.second;
-			if (group.size() == 0) continue;
-			for (int i = 0; i < group.size();)
-			{
-				if (!GetGamerenaState(*group[i])->Active)
-					group.erase(group.begin() + i);
-				else
-					++i;
-			}
-			if (pair.second.size() == 0)
-			{
-				auto iter = find(ActiveGroups.begin(),
-					ActiveGroups.end(), pair.first);
-				ActiveGroups.erase(iter);
-			}
-		}
+		writer.Put((int)SnapshotTag);
+		writer.Put(Now);
+		writer.Put(Seq);
+		writer.Put(Count);
+		writer.PutList(Seqs);
+		writer.PutList(Items);
+	}
+	virtual void Load(SnapshotReader& reader)
+	{
+		reader.Expect(SnapshotTag, "snapshot was taken from another queue type.");
+		reader.Get(Now);
+		reader.Get(Seq);
+		reader.Get(Count);
+		reader.GetList(Seqs);
+		reader.GetList(Items);
 	}
 private:
-	bool UpdateFlag = true;
-	List<size_t> ActiveGroups;
-	HashMap<size_t, List<Container<Entity>>> Entities;
-	Entity* _LastTarget;
+	enum { SnapshotTag = 0x48454150 };
+	int Now = 0; // 上一次出队的时刻
+	uint64_t Seq = 0;
+	size_t Count = 0;
+	List<uint64_t> Seqs; // 0 表示不在队列中
+	List<Item> Items;
 };
 
-class Game
+inline int CountTrailingZeros(uint64_t x)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return index;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+// 时间轮实现: 行动等待时间有界(见 Dispatcher::SetNextActionTime), 轮上每个
+// 槽恰好对应一个时刻, 槽内为按入队顺序排列的双向链表, 用位图查找下一个
+// 非空槽. 入队, 出队和删除都是 O(1). 超出轮长的时刻先放在溢出堆中, 进入
+// 范围后再按入队顺序插入对应的槽.
+class TimingWheelDispatchQueue : public IDispatchQueue
 {
+	static const int WheelBits = 8;
+	static const int WheelSize = 1 << WheelBits;
+	static const int Mask = WheelSize - 1;
+	enum { None = -1, Overflowed = -2 };
+	struct Item
+	{
+		int Time;
+		int Id;
+		uint64_t Seq;
+	};
+	static bool Later(const Item& lhs, const Item& rhs)
+	{
+		if (lhs.Time != rhs.Time) return lhs.Time > rhs.Time;
+		return lhs.Seq > rhs.Seq;
+	}
 public:
-	Game()
+	TimingWheelDispatchQueue()
 	{
-		auto listener = [&](Dispatcher* d, int time)
+		fill(begin(Heads), end(Heads), None);
+		fill(begin(Tails), end(Tails), None);
+	}
+	virtual void Push(int id, int time)
+	{
+		if (Slots.size() <= (size_t)id)
 		{
-			if (time == -1)
+			Slots.resize(id + 1, None);
+			Times.resize(id + 1);
+			Seqs.resize(id + 1);
+			Prev.resize(id + 1);
+			Next.resize(id + 1);
+		}
+		Remove(id);
+		time = max(time, Now); // 见 IDispatchQueue::Push
+		Times[id] = time;
+		Seqs[id] = ++Seq;
+		++Count;
+		if (time - Now >= WheelSize)
+		{
+			Slots[id] = Overflowed;
+			Overflow.push_back({ time, id, Seq });
+			push_heap(Overflow.begin(), Overflow.end(), Later);
+			return;
+		}
+		Link(id, time & Mask);
+	}
+	virtual bool Pop(int& id, int& time)
+	{
+		if (Count == 0) return false;
+		Migrate();
+		int slot = FindSlot(Now & Mask);
+		if (slot == None)
+		{ // 轮上已空, 直接跳到溢出堆中最早的时刻
+			Now = Overflow.front().Time;
+			Migrate();
+			slot = FindSlot(Now & Mask);
+		}
+		id = Heads[slot];
+		time = Now = Times[id];
+		Unlink(id);
+		Slots[id] = None;
+		--Count;
+		return true;
+	}
+	// 不推进 Now, 否则之后入队的较早时刻会被推迟
+	virtual bool Peek(int& id, int& time)
+	{
+		if (Count == 0) return false;
+		Migrate();
+		int slot = FindSlot(Now & Mask);
+		if (slot != None)
+			id = Heads[slot];
+		else
+		{ // 轮上已空, 取溢出堆中最早的有效项
+			while (Slots[Overflow.front().Id] != Overflowed
+				|| Seqs[Overflow.front().Id] != Overflow.front().Seq)
 			{
-				DispatcherErrorHandler(d);
-				return;
+				pop_heap(Overflow.begin(), Overflow.end(), Later);
+				Overflow.pop_back();
 			}
-		};
-		tDispatcher.SetListener(listener);
+			id = Overflow.front().Id;
+		}
+		time = Times[id];
+		return true;
 	}
-	void AddName(const string& groupName, const string& name)
+	virtual void Remove(int id)
 	{
-		size_t hashCode = hash<string>()(groupName);
-		GamerenaAttribute attr(groupName, name);
-		attr.AddAction([&](Entity* e)
-			{
-				auto iattr = e->GetModifiedAttribute();
-				GamerenaAttribute& attr =
-					*(GamerenaAttribute*)iattr.get();
-				SkillInfo skill = attr.tSkillSelector.RandomSkill();
-				Entity* target = nullptr;
-				switch (skill.TargetType)
-				{
-				case Targets.Enemy:
-					target = tTargetSelector.GetRandomTarget(e);
-					break;
-				case Targets.Teammate:
-					target = tTargetSelector.GetRandomTeammate(e);
-					break;
-				}
-				skill.Skill(e, target);
-			});
-		auto entity = Container<Entity>(new Entity(&attr, nullptr));
-		auto state = GetGamerenaState(*entity);
-		state->OnDeath.push_back([&](GamerenaState*){
-			tTargetSelector.SetUpdateFlag();
-		});
-		Groups[hashCode].push_back(entity);
-		tDispatcher.AddEntity(entity);
-		tTargetSelector.AddEntity(entity);
+		if (!Contains(id)) return;
+		if (Slots[id] != Overflowed)
+			Unlink(id);
+		Slots[id] = None;
+		--Count;
 	}
-	void Start()
+	virtual bool Contains(int id)const
 	{
-		while (!IsDone())
-			tDispatcher.DispatchNext();
+		return (size_t)id < Slots.size() && Slots[id] != None;
 	}
-	using Group = List<Container<Entity>>;
-	const HashMap<size_t, Group>& GetGroups()const
+	virtual size_t Size()const { return Count; }
+	virtual void Clear()
 	{
-		return Groups;
+		Now = 0;
+		Seq = 0;
+		Count = 0;
+		fill(begin(Heads), end(Heads), None);
+		fill(begin(Tails), end(Tails), None);
+		fill(begin(Bits), end(Bits), 0);
+		fill(Slots.begin(), Slots.end(), None);
+		Overflow.clear();
 	}
-	bool IsDone()
+	virtual void Save(SnapshotWriter& writer)const
 	{
-		if (DoneFlag)
-			return true;
-		if (tTargetSelector.GroupsKeep() < 2)
-			return DoneFlag = true;
-		return false;
+		writer.Put((int)SnapshotTag);
+		writer.Put(Now);
+		writer.Put(Seq);
+		writer.Put(Count);
+		writer.PutArray(Heads, WheelSize);
+		writer.PutArray(Tails, WheelSize);
+		writer.PutArray(Bits, WheelSize / 64);
+		writer.PutList(Slots);
+		writer.PutList(Times);
+		writer.PutList(Seqs);
+		writer.PutList(Prev);
+		writer.PutList(Next);
+		writer.PutList(Overflow);
 	}
-protected:
-	void DispatcherErrorHandler(Dispatcher* d)
+	virtual void Load(SnapshotReader& reader)
 	{
-		//TODO
-		DoneFlag = true;
+		reader.Expect(SnapshotTag, "snapshot was taken from another queue type.");
+		reader.Get(Now);
+		reader.Get(Seq);
+		reader.Get(Count);
+		reader.GetArray(Heads, WheelSize);
+		reader.GetArray(Tails, WheelSize);
+		reader.GetArray(Bits, WheelSize / 64);
+		reader.GetList(Slots);
+		reader.GetList(Times);
+		reader.GetList(Seqs);
+		reader.GetList(Prev);
+		reader.GetList(Next);
+		reader.GetList(Overflow);
 	}
 private:
-	bool DoneFlag = false;
-	Dispatcher tDispatcher;
-	TargetSelector tTargetSelector;
-	HashMap<size_t, Group> Groups;
+	enum { SnapshotTag = 0x57484545 };
+	void Link(int id, int slot)
+	{ // 按入队顺序插入, 通常直接接在尾部
+		int prev = Tails[slot];
+		while (prev != None && Seqs[prev] > Seqs[id])
+			prev = Prev[prev];
+		int next = prev == None ? Heads[slot] : Next[prev];
+		Prev[id] = prev;
+		Next[id] = next;
+		(prev == None ? Heads[slot] : Next[prev]) = id;
+		(next == None ? Tails[slot] : Prev[next]) = id;
+		Slots[id] = slot;
+		Bits[slot >> 6] |= 1ull << (slot & 63);
+	}
+	void Unlink(int id)
+	{
+		int slot = Slots[id];
+		int prev = Prev[id];
+		int next = Next[id];
+		(prev == None ? Heads[slot] : Next[prev]) = next;
+		(next == None ? Tails[slot] : Prev[next]) = prev;
+		if (Heads[slot] == None)
+			Bits[slot >> 6] &= ~(1ull << (slot & 63));
+	}
+	void Migrate()
+	{
+		while (!Overflow.empty())
+		{
+			const Item& item = Overflow.front();
+			bool valid =
+				Slots[item.Id] == Overflowed && Seqs[item.Id] == item.Seq;
+			if (valid && item.Time - Now >= WheelSize)
+				break;
+			int id = item.Id;
+			pop_heap(Overflow.begin(), Overflow.end(), Later);
+			Overflow.pop_back();
+			if (valid)
+				Link(id, Times[id] & Mask);
+		}
+	}
+	int FindSlot(int start)const
+	{
+		const int Words = WheelSize / 64;
+		int word = start >> 6;
+		uint64_t bits = Bits[word] & (~0ull << (start & 63));
+		for (int i = 0; i <= Words; ++i)
+		{
+			if (bits)
+				return (word << 6) + CountTrailingZeros(bits);
+			word = (word + 1) % Words;
+			bits = Bits[word];
+		}
+		return None;
+	}
+	int Now = 0;
+	uint64_t Seq = 0;
+	size_t Count = 0;
+	int Heads[WheelSize] = {};
+	int Tails[WheelSize] = {};
+	uint64_t Bits[WheelSize / 64] = {};
+	List<int> Slots;
+	List<int> Times;
+	List<uint64_t> Seqs;
+	List<int> Prev;
+	List<int> Next;
+	List<Item> Overflow;
 };
 
-void ShowObject(const Entity& e, int space, int level);
+// 运行时性能计数. 每个线程写自己的计数块, 不加锁; 输出时再汇总所有线程.
+// 次数精确计数; 读时钟本身与被测代码耗时相当, 所以耗时只对每 SampleRate
+// 次中的一次采样, 平均值与直方图都来自采样.
+enum class PerfMetric : uint8_t
+{
+	Dispatch,
+	TargetSelection,
+	SkillSelection,
+	Damage,
+	Modifier,
+	Output,
+	Count
+};
 
-void CausePhysicDamage(Entity* p, Entity* t, double dmgFactor = 1.0)
+class PerfCounters
 {
-	GamerenaState& pState = *GetGamerenaState(*p);
-	GamerenaState& tState = *GetGamerenaState(*t);
-	auto piAttr = p->GetModifiedAttribute();
-	auto tiAttr = t->GetModifiedAttribute();
-	GamerenaAttribute& pAttr = *(GamerenaAttribute*)piAttr.get();
-	GamerenaAttribute& tAttr = *(GamerenaAttribute*)tiAttr.get();
-	// 闪避判定
-	const int BaseDodgeChance = 16;
-	int dodgeChance = BaseDodgeChance
-		+ (tAttr.BaseAccuracy - pAttr.BaseAccuracy) / 4
-		+ (tAttr.BaseDefense - pAttr.BaseAttack) / 8;
-	if (Random(100) < dodgeChance)
+public:
+	enum { Buckets = 32 }; // 第 i 个桶记录耗时在 [2^i, 2^(i+1)) 纳秒内的次数
+	enum { SampleRate = 64 };
+	struct Metric
 	{
-		cout << " 但 " << tAttr.GetName() << " 闪避了攻击.\n";
-		return;
+		uint64_t Count = 0;
+		uint64_t Samples = 0;
+		uint64_t TotalNs = 0; // 采样的总耗时
+		uint64_t MaxNs = 0;
+		uint64_t Histogram[Buckets] = {};
+	};
+	// 计数一次; 返回 true 时调用者应测量这一次的耗时并交给 Record
+	static bool Count(PerfMetric metric)
+	{
+		Block::Metric& m = Local().Metrics[(int)metric];
+		// 只有本线程写入; 用原子量只是为了让汇总时的读取不构成数据竞争
+		uint64_t count = m.Count.load(memory_order_relaxed);
+		m.Count.store(count + 1, memory_order_relaxed);
+		return count % SampleRate == 0;
 	}
-	const int BaseDamage = 15;
-	int damage = max(1,
-		(int)(BaseDamage
-			+ pAttr.BaseAttack * 0.3 + pAttr.BaseAttack * 0.9 * Random()
-			- tAttr.BaseDefense * 0.2 + tAttr.BaseDefense * 1.3 * Random()));
-	cout << " 对 " << tAttr.GetName() << " 造成了 " << damage << "点伤害.\n";
-	pState.Score += damage;
-	tState.GetDamage(damage);
-	ShowObject(*t, 4, 0);
-	if (tState.Active == false)
+	static void Record(PerfMetric metric, uint64_t ns)
 	{
-		pState.Score += 30;
-		cout << tAttr.GetName() << " 死亡了, 凶手是 " << pAttr.GetName() << '\n';
+		Block::Metric& m = Local().Metrics[(int)metric];
+		Add(m.Samples, 1);
+		Add(m.TotalNs, ns);
+		if (ns > m.MaxNs.load(memory_order_relaxed))
+			m.MaxNs.store(ns, memory_order_relaxed);
+		int bucket = 0;
+		while (bucket + 1 < Buckets && (ns >> (bucket + 1)) != 0)
+			++bucket;
+		Add(m.Histogram[bucket], 1);
 	}
-}
-
-void CauseMagicDamage(Entity* p, Entity* t, double dmgFactor = 1.0)
-{
-	GamerenaState& pState = *GetGamerenaState(*p);
-	GamerenaState& tState = *GetGamerenaState(*t);
-	auto piAttr = p->GetModifiedAttribute();
-	auto tiAttr = t->GetModifiedAttribute();
-	GamerenaAttribute& pAttr = *(GamerenaAttribute*)piAttr.get();
-	GamerenaAttribute& tAttr = *(GamerenaAttribute*)tiAttr.get();
-	// 闪避判定
-	const int BaseDodgeChance = 25;
-	int dodgeChance = BaseDodgeChance
-		- pAttr.BaseIntelligence >> 3
-		+ (tAttr.BaseAccuracy - pAttr.BaseAccuracy) / 8
-		+ (tAttr.BaseMagicDefense - pAttr.BaseMagic) / 8;
-	if (Random(100) < dodgeChance)
+	// 所有线程(包括已退出的线程)的累计值
+	static Metric Collect(PerfMetric metric)
 	{
-		cout << " 但 " << tAttr.GetName() << " 闪避了攻击.\n";
-		return;
+		Metric result;
+		Registry& registry = GetRegistry();
+		lock_guard<mutex> lock(registry.Lock);
+		for (Block* block : registry.Blocks)
+		{
+			const Block::Metric& m = block->Metrics[(int)metric];
+			result.Count += m.Count.load(memory_order_relaxed);
+			result.Samples += m.Samples.load(memory_order_relaxed);
+			result.TotalNs += m.TotalNs.load(memory_order_relaxed);
+			result.MaxNs = max<uint64_t>(result.MaxNs, m.MaxNs.load(memory_order_relaxed));
+			for (int i = 0; i < Buckets; ++i)
+				result.Histogram[i] += m.Histogram[i].load(memory_order_relaxed);
+		}
+		return result;
 	}
+	static const char* GetName(PerfMetric metric)
+	{
+		static const char* Names[] = {
+			"dispatch", "target_selection", "skill_selection",
+			"damage", "modifier", "output"
+		};
+		return Names[(int)metric];
+	}
+private:
+	struct Block
+	{
+		struct Metric
+		{
+			atomic<uint64_t> Count{ 0 };
+			atomic<uint64_t> Samples{ 0 };
+			atomic<uint64_t> TotalNs{ 0 };
+			atomic<uint64_t> MaxNs{ 0 };
+			atomic<uint64_t> Histogram[Buckets] = {};
+		};
+		Metric Metrics[(int)PerfMetric::Count];
+	};
+	// 线程退出时计数块留在登记表中, 由之后的新线程接着使用, 因此数量不超过
+	// 同时存在的线程数
+	struct Registry
+	{
+		mutex Lock;
+		List<Block*> Blocks;
+		List<Block*> Free;
+	};
+	struct Owner
+	{
+		Block* tBlock;
+		Owner()
+		{
+			Registry& registry = GetRegistry();
+			lock_guard<mutex> lock(registry.Lock);
+			if (registry.Free.empty())
+			{
+				tBlock = new Block();
+				registry.Blocks.push_back(tBlock);
+			}
+			else
+			{
+				tBlock = registry.Free.back();
+				registry.Free.pop_back();
+			}
+		}
+		~Owner()
+		{
+			Registry& registry = GetRegistry();
+			lock_guard<mutex> lock(registry.Lock);
+			registry.Free.push_back(tBlock);
+		}
+	};
+	static void Add(atomic<uint64_t>& counter, uint64_t value)
+	{
+		counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+	}
+	static Block& Local()
+	{
+		thread_local Owner owner;
+		return *owner.tBlock;
+	}
+	static Registry& GetRegistry()
+	{
+		// 不析构: 线程可能在静态对象析构之后才退出
+		static Registry* registry = new Registry();
+		return *registry;
+	}
+};
+
+// 计数所在作用域, 被采样时记录其耗时
+class PerfScope
+{
+public:
+	explicit PerfScope(PerfMetric metric) :
+		tMetric(metric), Sampled(PerfCounters::Count(metric))
+	{
+		if (Sampled) Begin = chrono::steady_clock::now();
+	}
+	PerfScope(const PerfScope&) = delete;
+	PerfScope& operator=(const PerfScope&) = delete;
+	~PerfScope()
+	{
+		if (!Sampled) return;
+		PerfCounters::Record(tMetric, chrono::duration_cast<chrono::nanoseconds>(
+			chrono::steady_clock::now() - Begin).count());
+	}
+private:
+	PerfMetric tMetric;
+	bool Sampled;
+	chrono::steady_clock::time_point Begin;
+};
+
+class Dispatcher
+{
+	int SetNextActionTime(Container<Entity> e)
+	{
+		int waitTime = RollWaitTime(GetGamerenaStats(*e).BaseSpeed, *Rng);
+		GetGamerenaState(*e)->SetNextActionTime(Time + waitTime);
+		return Time + waitTime;
+	}
+	bool IsActive(int id)const
+	{
+		if (Store) return Store->Active[id] != 0;
+		return GetGamerenaState(*Entities[id])->Active;
+	}
+public:
+	Dispatcher() : Queue(new TimingWheelDispatchQueue()) {}
+	static int RollWaitTime(int speed, RandomEngine& rng)
+	{
+		const int BaseWaitTime = 160;
+		// BaseWaitTime(160) - [0.3, 0.8) * Speed[30,100) => WaitTime (80, 151]
+		return BaseWaitTime - speed * 0.3 - (speed >> 1) * rng.Random();
+	}
+	void SetListener(const function<void(Dispatcher*, int)>& listener)
+	{
+		Listener = listener;
+	}
+	// 设置后由它代替 Entity::DoActions 执行实体的行动
+	void SetActionHandler(const Delegate<void(Entity*)>& handler)
+	{
+		ActionHandler = handler;
+	}
+	// 时刻推进之后, 实体行动之前调用
+	void SetTimeHandler(const Delegate<void(int)>& handler)
+	{
+		TimeHandler = handler;
+	}
+	void SetStatStore(StatStore* store)
+	{
+		Store = store;
+	}
+	void SetRandomEngine(RandomEngine* rng)
+	{
+		Rng = rng;
+	}
+	// 更换调度队列的实现, 已在队列中的实体按原有顺序迁移
+	void SetQueue(Container<IDispatchQueue> queue)
+	{
+		if (queue == nullptr)
+			throw NullArgumentException("queue can\'t be null.");
+		int id, time;
+		while (Queue->Pop(id, time))
+			queue->Push(id, time);
+		Queue = queue;
+	}
+	void AddEntity(Container<Entity> entity)
+	{
+		int id = GetGamerenaState(*entity)->Id;
+		if (id < 0)
+			throw InvalidArgumentException("entity has no id.");
+		if (Entities.size() <= (size_t)id)
+			Entities.resize(id + 1);
+		Entities[id] = entity;
+		Queue->Push(id, SetNextActionTime(entity));
+	}
+	void RemoveEntity(int id)
+	{
+		Queue->Remove(id);
+	}
+	// 回到时刻 0, 按编号顺序重新安排所有实体, 与依次 AddEntity 的结果相同
+	void Reset()
+	{
+		Time = 0;
+		_LastEntity = nullptr;
+		Queue->Clear();
+		for (size_t id = 0; id < Entities.size(); ++id)
+			if (Entities[id])
+				Queue->Push(id, SetNextActionTime(Entities[id]));
+	}
+	// 没有可以行动的实体时通知 Listener(-1) 并返回 false
+	bool DispatchNext()
+	{
+		PerfScope perf(PerfMetric::Dispatch);
+		int id = -1, time;
+		while (Queue->Size() > 1)
+		{
+			Queue->Pop(id, time);
+			if (IsActive(id)) break;
+			id = -1;
+		}
+		if (id < 0)
+		{
+			Listener(this, -1);
+			return false;
+		}
+		Time = time;
+		if (TimeHandler) TimeHandler(Time);
+		auto& entity = Entities[id];
+		int nextTime = SetNextActionTime(entity);
+		if (ActionHandler) ActionHandler(entity.get());
+		else entity->DoActions();
+		_LastEntity = entity.get();
+		if (IsActive(id))
+			Queue->Push(id, nextTime);
+		if (Listener) Listener(this, Time);
+		return true;
+	}
+	// 取出下一时刻所有可以行动的实体, 按出队顺序放入 ids; 之后由调用者逐个
+	// 交给 Schedule. 与 DispatchNext 一样, 没有可以行动的实体时通知
+	// Listener(-1) 并返回 false.
+	bool PopTick(List<int>& ids)
+	{
+		PerfScope perf(PerfMetric::Dispatch);
+		ids.clear();
+		int id = -1, time;
+		while (Queue->Size() > 1)
+		{
+			Queue->Pop(id, time);
+			if (IsActive(id)) break;
+			id = -1;
+		}
+		if (id < 0)
+		{
+			Listener(this, -1);
+			return false;
+		}
+		Time = time;
+		ids.push_back(id);
+		while (Queue->Peek(id, time) && time == Time)
+		{
+			Queue->Pop(id, time);
+			if (IsActive(id)) ids.push_back(id);
+		}
+		if (TimeHandler) TimeHandler(Time);
+		return true;
+	}
+	// PopTick 取出的实体行动完毕后调用, 仍存活时于 nextTime 再次行动
+	void Schedule(int id, int nextTime)
+	{
+		auto& entity = Entities[id];
+		GetGamerenaState(*entity)->SetNextActionTime(nextTime);
+		_LastEntity = entity.get();
+		if (IsActive(id))
+			Queue->Push(id, nextTime);
+		if (Listener) Listener(this, Time);
+	}
+	Entity* LastEntity()const
+	{
+		return _LastEntity;
+	}
+	int GetCurrentTime()const
+	{
+		return Time;
+	}
+	size_t GetQueueSize()const
+	{
+		return Queue->Size();
+	}
+	void Save(SnapshotWriter& writer)const
+	{
+		writer.Put(Time);
+		writer.Put(_LastEntity ? GetGamerenaState(*_LastEntity)->Id : -1);
+		Queue->Save(writer);
+	}
+	void Load(SnapshotReader& reader)
+	{
+		int last;
+		reader.Get(Time);
+		reader.Get(last);
+		_LastEntity = last < 0 ? nullptr : Entities[last].get();
+		Queue->Load(reader);
+	}
+private:
+	int	Time = 0;
+	function<void(Dispatcher*, int)> Listener;
+	Delegate<void(int)> TimeHandler;
+	Delegate<void(Entity*)> ActionHandler;
+	Container<IDispatchQueue> Queue;
+	List<Container<Entity>> Entities;
+	StatStore* Store = nullptr;
+	RandomEngine* Rng = nullptr;
+	Entity* _LastEntity = nullptr;
+};
+
+// 每组存活实体保存在连续数组中, 并记录每个实体在数组中的位置, 死亡时与
+// 末尾交换后删除; 仍有存活者的组同样以数组加位置维护. 选择目标和处理死亡
+// 都是 O(1).
+class TargetSelector
+{
+public:
+	// TODO: GetRandomTarget()是最简单的实现; 具体选择算法实现将会取决于Int
+	Entity* GetRandomTarget(Entity* entity)
+	{
+		return _LastTarget = GetRandomTarget(entity, *Rng);
+	}
+	Entity* GetRandomTeammate(Entity* entity)
+	{
+		int id = GetGamerenaState(*entity)->Id;
+		Entity* target = GetRandomTeammate(entity, *Rng);
+		if (!IsRegistered(id)) _LastTarget = target;
+		return target;
+	}
+	// 使用给定的随机数生成器且不修改选择器, 可由多个线程同时调用
+	Entity* GetRandomTarget(Entity* entity, RandomEngine& rng)const
+	{
+		int id = GetGamerenaState(*entity)->Id;
+		int nth = IsRegistered(id) ? ActivePositions[EntityGroups[id]] : -1;
+		if (nth < 0)
+		{
+			int select = ActiveGroups[rng.Random(ActiveGroups.size())];
+			return RandomMember(select, rng);
+		}
+		int nthSelect = rng.Random(ActiveGroups.size() - 1);
+		if (nthSelect >= nth) ++nthSelect;
+		return RandomMember(ActiveGroups[nthSelect], rng);
+	}
+	Entity* GetRandomTeammate(Entity* entity, RandomEngine& rng)const
+	{
+		int id = GetGamerenaState(*entity)->Id;
+		if (!IsRegistered(id))
+		{
+			int select = ActiveGroups[rng.Random(ActiveGroups.size())];
+			return RandomMember(select, rng);
+		}
+		if (Members[EntityGroups[id]].size() > 0)
+			return RandomMember(EntityGroups[id], rng);
+		return entity;
+	}
+	void SetRandomEngine(RandomEngine* rng)
+	{
+		Rng = rng;
+	}
+	void AddEntity(Container<Entity> entity)
+	{
+		auto state = GetGamerenaState(*entity);
+		int id = state->Id;
+		if (id < 0)
+			throw InvalidArgumentException("entity has no id.");
+		Symbol key = state->GroupIndex;
+		if (GroupIndices.size() <= key)
+			GroupIndices.resize(key + 1, -1);
+		if (GroupIndices[key] < 0)
+		{
+			GroupIndices[key] = GroupKeys.size();
+			GroupKeys.push_back(key);
+			Members.emplace_back();
+			ActivePositions.push_back(-1);
+		}
+		int group = GroupIndices[key];
+		if (Entities.size() <= (size_t)id)
+		{
+			Entities.resize(id + 1);
+			EntityGroups.resize(id + 1, -1);
+			MemberPositions.resize(id + 1, -1);
+		}
+		Entities[id] = entity;
+		EntityGroups[id] = group;
+		if (state->IsActive())
+			InsertMember(id);
+	}
+	// 实体死亡时调用; 对不在存活集合中的实体没有影响
+	void RemoveEntity(int id)
+	{
+		if (!IsRegistered(id) || MemberPositions[id] < 0)
+			return;
+		int group = EntityGroups[id];
+		SwapRemove(Members[group], MemberPositions, MemberPositions[id]);
+		if (Members[group].empty())
+			SwapRemove(ActiveGroups, ActivePositions, ActivePositions[group]);
+	}
+	// 所有已登记的实体恢复存活, 存活集合按编号顺序重建, 与依次 AddEntity
+	// 的结果相同
+	void Reset()
+	{
+		ActiveGroups.clear();
+		for (auto& members : Members)
+			members.clear();
+		fill(ActivePositions.begin(), ActivePositions.end(), -1);
+		fill(MemberPositions.begin(), MemberPositions.end(), -1);
+		_LastTarget = nullptr;
+		for (size_t id = 0; id < EntityGroups.size(); ++id)
+			if (IsRegistered(id))
+				InsertMember(id);
+	}
+	Entity* LastTarget()
+	{
+		return _LastTarget;
+	}
+	// 与实体 id 同组的存活实体编号; 未登记的实体返回空表
+	const List<int>& GetAliveMembers(int id)const
+	{
+		static const List<int> Empty;
+		return IsRegistered(id) ? Members[EntityGroups[id]] : Empty;
+	}
+	int GroupsKeep()const
+	{
+		return ActiveGroups.size();
+	}
+	// 仍有存活者的组, 以组编号表示
+	const List<int>& GetActiveGroups()const
+	{
+		return ActiveGroups;
+	}
+	Symbol GetGroupKey(int group)const
+	{
+		return GroupKeys[group];
+	}
+	// 只保存存活集合; 实体与组的登记在对局开始后不再变化
+	void Save(SnapshotWriter& writer)const
+	{
+		writer.Put(Members.size());
+		for (auto& members : Members)
+			writer.PutList(members);
+		writer.PutList(MemberPositions);
+		writer.PutList(ActiveGroups);
+		writer.PutList(ActivePositions);
+		writer.Put(_LastTarget ? GetGamerenaState(*_LastTarget)->Id : -1);
+	}
+	void Load(SnapshotReader& reader)
+	{
+		size_t groups;
+		reader.Get(groups);
+		if (groups != Members.size())
+			throw InvalidArgumentException("snapshot has different groups.");
+		for (auto& members : Members)
+			reader.GetList(members);
+		reader.GetList(MemberPositions);
+		reader.GetList(ActiveGroups);
+		reader.GetList(ActivePositions);
+		int last;
+		reader.Get(last);
+		_LastTarget = last < 0 ? nullptr : Entities[last].get();
+	}
+protected:
+	bool IsRegistered(int id)const
+	{
+		return (size_t)id < EntityGroups.size() && EntityGroups[id] >= 0;
+	}
+	void InsertMember(int id)
+	{
+		int group = EntityGroups[id];
+		if (Members[group].empty())
+		{
+			ActivePositions[group] = ActiveGroups.size();
+			ActiveGroups.push_back(group);
+		}
+		MemberPositions[id] = Members[group].size();
+		Members[group].push_back(id);
+	}
+	// 把 list[pos] 与末尾交换后删除, 并维护 positions 中的反向索引
+	static void SwapRemove(List<int>& list, List<int>& positions, int pos)
+	{
+		int removed = list[pos];
+		int last = list.back();
+		list[pos] = last;
+		positions[last] = pos;
+		list.pop_back();
+		positions[removed] = -1;
+	}
+	Entity* RandomMember(int group, RandomEngine& rng)const
+	{
+		auto& members = Members[group];
+		return Entities[members[rng.Random(members.size())]].get();
+	}
+private:
+	List<int> ActiveGroups;
+	List<int> ActivePositions;
+	List<List<int>> Members;
+	List<int> MemberPositions;
+	List<int> EntityGroups;
+	List<int> GroupIndices; // 以组名的 Symbol 为下标, -1 表示未出现
+	List<Symbol> GroupKeys;
+	List<Container<Entity>> Entities;
+	RandomEngine* Rng = nullptr;
+	Entity* _LastTarget = nullptr;
+};
+
+// 战斗事件. Subject 为事件的主体(行动者, 闪避/受伤/治疗/死亡的一方,
+// 修饰器的持有者), HP/MaxHP/Active 是事件发生后主体的状态, 用于输出血条.
+struct BattleEvent
+{
+	// Miss: 同一时刻并行结算时, 目标已被先结算的行动击杀
+	enum : uint8_t { Action, Dodge, Damage, MagicDamage, Heal, Death, Miss,
+		ModifierAdded, ModifierExpired };
+	uint8_t Type;
+	uint8_t Detail; // Action: 技能文本编号
+	uint8_t Active;
+	int Time;
+	int Subject;
+	int Other; // Action: 目标; 受伤/治疗/死亡: 来源; 修饰器: -1
+	int Value; // 修饰器: 修饰器编号
+	int HP;
+	int MaxHP;
+};
+
+// 对局的事件总线, 每个 Game 一份. 订阅者按事件类型登记一次, 而不是在每个
+// 实体上挂委托. 事件只在状态真正改变时发布(例如死亡只随致死的那次伤害
+// 发布一次); 没有订阅者的类型在构造事件之前就被跳过. 订阅时可指定 batch,
+// 事件先积攒在缓冲区中, 满 batch 个或 Flush 时一次交给处理函数. 处理函数
+// 中不能订阅或退订.
+class EventBus
+{
+public:
+	using Handler = Delegate<void(const BattleEvent* events, size_t count)>;
+	enum : uint32_t { AllTypes = ~0u };
+	static uint32_t TypeBit(uint8_t type)
+	{
+		return 1u << type;
+	}
+	// types 为 TypeBit 之和; 返回的编号用于 Unsubscribe
+	int Subscribe(uint32_t types, const Handler& handler, size_t batch = 1)
+	{
+		if (!handler)
+			throw InvalidArgumentException("handler is null/invalid.");
+		Subscriber subscriber;
+		subscriber.Types = types;
+		subscriber.tHandler = handler;
+		subscriber.Batch = max<size_t>(batch, 1);
+		subscriber.Pending.reserve(subscriber.Batch);
+		Subscribers.push_back(move(subscriber));
+		Mask |= types;
+		return Subscribers.size() - 1;
+	}
+	// 先投递缓冲中的事件
+	void Unsubscribe(int id)
+	{
+		if (id < 0 || (size_t)id >= Subscribers.size() || !Subscribers[id].tHandler)
+			return;
+		Deliver(Subscribers[id]);
+		Subscribers[id] = Subscriber();
+		Mask = 0;
+		for (auto& subscriber : Subscribers)
+			Mask |= subscriber.Types;
+	}
+	bool Wants(uint8_t type)const
+	{
+		return (Mask >> type) & 1;
+	}
+	void Publish(const BattleEvent& e)
+	{
+		for (auto& subscriber : Subscribers)
+		{
+			if (((subscriber.Types >> e.Type) & 1) == 0)
+				continue;
+			if (subscriber.Batch == 1)
+			{
+				subscriber.tHandler(&e, 1);
+				continue;
+			}
+			subscriber.Pending.push_back(e);
+			if (subscriber.Pending.size() >= subscriber.Batch)
+				Deliver(subscriber);
+		}
+	}
+	void Flush()
+	{
+		for (auto& subscriber : Subscribers)
+			Deliver(subscriber);
+	}
+private:
+	struct Subscriber
+	{
+		uint32_t Types = 0;
+		Handler tHandler;
+		size_t Batch = 1;
+		List<BattleEvent> Pending;
+	};
+	static void Deliver(Subscriber& subscriber)
+	{
+		if (subscriber.Pending.empty()) return;
+		subscriber.tHandler(subscriber.Pending.data(), subscriber.Pending.size());
+		subscriber.Pending.clear();
+	}
+	List<Subscriber> Subscribers;
+	uint32_t Mask = 0;
+};
+
+// 单生产者单消费者的事件环形队列. 模拟线程只写入队列, 独立的消费线程负责
+// 处理(例如输出文字). 队列满时暂存在生产者一侧的溢出表中, 模拟线程永远
+// 不会因输出而阻塞.
+class EventLog
+{
+public:
+	using Consumer = Delegate<void(const BattleEvent&)>;
+	explicit EventLog(const Consumer& consumer, size_t capacityBits = 16) :
+		Events(size_t(1) << capacityBits),
+		Mask((size_t(1) << capacityBits) - 1),
+		tConsumer(consumer)
+	{
+		if (!tConsumer)
+			throw InvalidArgumentException("consumer is null/invalid.");
+		Worker = thread([this]() { Consume(); });
+	}
+	EventLog(const EventLog&) = delete;
+	EventLog& operator=(const EventLog&) = delete;
+	~EventLog()
+	{
+		Close();
+	}
+	void Push(const BattleEvent& e)
+	{
+		if (!Pending.empty() && !DrainPending())
+		{
+			Pending.push_back(e);
+			return;
+		}
+		if (!TryPush(e))
+			Pending.push_back(e);
+	}
+	// 等待已写入的事件全部处理完毕; 只能由生产者调用
+	void Flush()
+	{
+		while (!DrainPending())
+			this_thread::yield();
+		while (Head.load(memory_order_acquire) != Tail.load(memory_order_relaxed))
+			this_thread::yield();
+	}
+	void Close()
+	{
+		if (!Worker.joinable()) return;
+		Flush();
+		Closed.store(true, memory_order_release);
+		Worker.join();
+	}
+private:
+	bool TryPush(const BattleEvent& e)
+	{
+		size_t tail = Tail.load(memory_order_relaxed);
+		if (tail - Head.load(memory_order_acquire) > Mask)
+			return false;
+		Events[tail & Mask] = e;
+		Tail.store(tail + 1, memory_order_release);
+		return true;
+	}
+	bool DrainPending()
+	{
+		size_t i = 0;
+		while (i < Pending.size() && TryPush(Pending[i]))
+			++i;
+		Pending.erase(Pending.begin(), Pending.begin() + i);
+		return Pending.empty();
+	}
+	void Consume()
+	{
+		size_t head = Head.load(memory_order_relaxed);
+		for (;;)
+		{
+			size_t tail = Tail.load(memory_order_acquire);
+			if (head == tail)
+			{
+				if (Closed.load(memory_order_acquire)
+					&& Tail.load(memory_order_acquire) == head)
+					return;
+				this_thread::sleep_for(chrono::microseconds(100));
+				continue;
+			}
+			for (; head != tail; ++head)
+				tConsumer(Events[head & Mask]);
+			Head.store(head, memory_order_release);
+		}
+	}
+	List<BattleEvent> Events;
+	const size_t Mask;
+	alignas(64) atomic<size_t> Head{ 0 };
+	alignas(64) atomic<size_t> Tail{ 0 };
+	atomic<bool> Closed{ false };
+	List<BattleEvent> Pending;
+	Consumer tConsumer;
+	thread Worker;
+};
+
+// 修饰器的到期管理. 按时间到期的项放在一个以 (到期时刻, 加入顺序) 排序的
+// 堆中, 按行动次数到期的项放在各实体自己的堆中; 每次只处理已到期的项.
+// 修饰器被提前手动移除时, 对应的项留在堆中, 到期时移除失败即可.
+class ModifierTimer
+{
+	struct Expiry
+	{
+		int Due;
+		int Entity;
+		uint64_t Seq;
+		size_t Modifier;
+	};
+	static bool Later(const Expiry& lhs, const Expiry& rhs)
+	{
+		if (lhs.Due != rhs.Due) return lhs.Due > rhs.Due;
+		return lhs.Seq > rhs.Seq;
+	}
+public:
+	// 在时刻 due 到期
+	void AddTimed(int entity, size_t modifier, int due)
+	{
+		TimeHeap.push_back({ due, entity, ++Seq, modifier });
+		push_heap(TimeHeap.begin(), TimeHeap.end(), Later);
+	}
+	// 在 entity 再完成 rounds 次行动后到期
+	void AddRounds(int entity, size_t modifier, int rounds)
+	{
+		if (Rounds.size() <= (size_t)entity)
+		{
+			Rounds.resize(entity + 1, 0);
+			RoundHeaps.resize(entity + 1);
+		}
+		auto& heap = RoundHeaps[entity];
+		heap.push_back({ Rounds[entity] + rounds, entity, ++Seq, modifier });
+		push_heap(heap.begin(), heap.end(), Later);
+	}
+	// 对每个在 time 之前(含)到期的项调用 expire(entity, modifier)
+	template <class Func>
+	void AdvanceTime(int time, Func&& expire)
+	{
+		while (!TimeHeap.empty() && TimeHeap.front().Due <= time)
+		{
+			Expiry item = TimeHeap.front();
+			pop_heap(TimeHeap.begin(), TimeHeap.end(), Later);
+			TimeHeap.pop_back();
+			expire(item.Entity, item.Modifier);
+		}
+	}
+	// entity 完成了一次行动
+	template <class Func>
+	void CompleteRound(int entity, Func&& expire)
+	{
+		if (Rounds.size() <= (size_t)entity) return;
+		int round = ++Rounds[entity];
+		auto& heap = RoundHeaps[entity];
+		while (!heap.empty() && heap.front().Due <= round)
+		{
+			Expiry item = heap.front();
+			pop_heap(heap.begin(), heap.end(), Later);
+			heap.pop_back();
+			expire(item.Entity, item.Modifier);
+		}
+	}
+	void Save(SnapshotWriter& writer)const
+	{
+		writer.Put(Seq);
+		writer.PutList(TimeHeap);
+		writer.PutList(Rounds);
+		for (auto& heap : RoundHeaps)
+			writer.PutList(heap);
+	}
+	// 去掉所有未到期的项, 保留已分配的空间
+	void Clear()
+	{
+		Seq = 0;
+		TimeHeap.clear();
+		fill(Rounds.begin(), Rounds.end(), 0);
+		for (auto& heap : RoundHeaps)
+			heap.clear();
+	}
+	void Load(SnapshotReader& reader)
+	{
+		reader.Get(Seq);
+		reader.GetList(TimeHeap);
+		reader.GetList(Rounds);
+		RoundHeaps.resize(Rounds.size());
+		for (auto& heap : RoundHeaps)
+			reader.GetList(heap);
+	}
+private:
+	uint64_t Seq = 0;
+	List<Expiry> TimeHeap;
+	List<int> Rounds; // 只记录加过按次数到期修饰器的实体
+	List<List<Expiry>> RoundHeaps;
+};
+
+// 范围魔法伤害的一批目标, 属性按列连续存放
+struct AreaDamageBatch
+{
+	List<int> Ids;
+	List<int> Accuracy;
+	List<int> MagicDefense;
+	List<double> Rolls; // 每个目标 3 个: [闪避..., 伤害..., 防御...]
+	List<int> Damage;   // 0 表示闪避
+	void Clear()
+	{
+		Ids.clear();
+		Accuracy.clear();
+		MagicDefense.clear();
+	}
+};
+
+// 固定数量的工作线程, 以 fork-join 方式执行并行循环, 调用线程也参与计算.
+// 线程在两次调用之间休眠, 避免每次并行都创建线程.
+class WorkerPool
+{
+public:
+	explicit WorkerPool(int threads)
+	{
+		for (int i = 1; i < threads; ++i)
+			Workers.emplace_back([this]() { Work(); });
+	}
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+	~WorkerPool()
+	{
+		{
+			lock_guard<mutex> lock(Lock);
+			Stopped = true;
+		}
+		Wake.notify_all();
+		for (auto& worker : Workers)
+			worker.join();
+	}
+	size_t GetThreadCount()const { return Workers.size() + 1; }
+	// 对 [0, count) 中的每个 i 调用 body(i), 全部完成后返回
+	void ParallelFor(size_t count, const Delegate<void(size_t)>& body)
+	{
+		{
+			lock_guard<mutex> lock(Lock);
+			Body = &body;
+			Count = count;
+			Next = 0;
+			Running = Workers.size();
+			++Generation;
+		}
+		Wake.notify_all();
+		Run();
+		unique_lock<mutex> lock(Lock);
+		Done.wait(lock, [this]() { return Running == 0; });
+		Body = nullptr;
+	}
+private:
+	void Run()
+	{
+		const size_t Batch = 16;
+		for (size_t begin; (begin = Next.fetch_add(Batch)) < Count;)
+		{
+			size_t end = min(begin + Batch, Count);
+			for (size_t i = begin; i < end; ++i)
+				(*Body)(i);
+		}
+	}
+	void Work()
+	{
+		uint64_t generation = 0;
+		for (;;)
+		{
+			{
+				unique_lock<mutex> lock(Lock);
+				Wake.wait(lock, [&]() { return Stopped || Generation != generation; });
+				if (Stopped) return;
+				generation = Generation;
+			}
+			Run();
+			lock_guard<mutex> lock(Lock);
+			if (--Running == 0)
+				Done.notify_one();
+		}
+	}
+	List<thread> Workers;
+	mutex Lock;
+	condition_variable Wake;
+	condition_variable Done;
+	const Delegate<void(size_t)>* Body = nullptr;
+	size_t Count = 0;
+	atomic<size_t> Next{ 0 };
+	size_t Running = 0;
+	uint64_t Generation = 0;
+	bool Stopped = false;
+};
+
+// Game 的完整快照. Data 是一段平坦的字节缓冲区; 只有带修饰器的实体才会在
+// Modifiers 中保存修饰器的副本(慢路径).
+struct GameSnapshot
+{
+	struct ModifierRecord
+	{
+		int Id;
+		List<Container<IModifier>> Modifiers;
+		List<size_t> ModifierIds;
+	};
+	List<char> Data;
+	List<ModifierRecord> Modifiers;
+};
+
+using Roster = List<pair<string, string>>; // (GroupName, Name)
+
+class ReplayException : public Exception
+{
+public:
+	ReplayException(const string& message) : Message(message) {}
+	virtual const char* what()noexcept { return Message.c_str(); }
+	string Message;
+};
+
+// 录像文件格式(整数均为小端序, varint 为无符号 LEB128):
+//   文件头: "GRPL", 版本(u32), 种子(u64), 是否使用 StatStore(u8),
+//           名单人数(varint), 每人的组名与名字(varint 长度 + 字节)
+//   记录流: 首个 varint v; v 为偶数时是一次行动, v / 2 为距上一次行动的
+//           时间差, 之后是行动者编号(varint); v 为奇数时是关键帧, v / 2 为
+//           关键帧的字节数: GameSnapshot::Data 的字节数(varint), 快照本身,
+//           之后是修饰器(见 PutModifiers)
+//   索引:   每个关键帧的 (时刻(i32), 之前的行动数(u64), 在文件中的偏移(u64))
+//   文件尾: 索引偏移(u64), 关键帧数(u64), 行动总数(u64), 结束时刻(i32), "GRPI"
+// 第一个关键帧记录开局时的局面, 因此总能从某个关键帧开始定位.
+struct ReplayKeyframe
+{
+	int Time;
+	uint64_t EventIndex;
+	uint64_t Offset;
+};
+
+class ReplayWriter
+{
+public:
+	// 每 keyframeInterval 次行动写入一个关键帧; tickMode 表示对局按时刻
+	// 结算(见 Game::SetTickThreads), 回放时同样按时刻结算
+	ReplayWriter(const string& path, const Roster& roster, uint64_t seed,
+		bool useStatStore = false, uint64_t keyframeInterval = 4096,
+		bool tickMode = false);
+	ReplayWriter(const ReplayWriter&) = delete;
+	ReplayWriter& operator=(const ReplayWriter&) = delete;
+	~ReplayWriter()
+	{
+		Close();
+	}
+	// 写入当前局面作为第一个关键帧; 由 Game::SetReplayWriter 调用
+	void Begin(const Game& game);
+	// 由 Game 在每次行动后调用
+	void Record(const Game& game);
+	// 写入索引与文件尾; 之后的记录被忽略
+	void Close();
+	// 局面中有无法写入的修饰器而没有写出的关键帧数
+	uint64_t GetSkippedKeyframes()const { return SkippedKeyframes; }
+private:
+	void WriteKeyframe(const Game& game);
+	void Flush();
+	ofstream Out;
+	List<char> Buffer;
+	uint64_t Written = 0;
+	uint64_t Interval;
+	uint64_t EventCount = 0;
+	int LastTime = 0;
+	List<ReplayKeyframe> Keyframes;
+	uint64_t SkippedKeyframes = 0;
+	GameSnapshot Snapshot;
+	List<char> KeyframeModifiers;
+	bool Closed = false;
+};
+
+class Game
+{
+	// 单个实体的可变状态. 逐个字段读写, 快照(以及录像)中不含填充字节
+	struct StateRecord
+	{
+		int HP;
+		int Score;
+		int NextActionTime;
+		Stage StageValue;
+		bool Active;
+		size_t ModifierCount;
+		void Save(SnapshotWriter& writer)const
+		{
+			writer.Put(HP);
+			writer.Put(Score);
+			writer.Put(NextActionTime);
+			writer.Put(StageValue);
+			writer.Put(Active);
+			writer.Put(ModifierCount);
+		}
+		void Load(SnapshotReader& reader)
+		{
+			reader.Get(HP);
+			reader.Get(Score);
+			reader.Get(NextActionTime);
+			reader.Get(StageValue);
+			reader.Get(Active);
+			reader.Get(ModifierCount);
+		}
+	};
+public:
+	explicit Game(uint64_t seed = 0) :
+		Pool(new MemoryPool(), [](MemoryPool* pool) { pool->Release(); }),
+		Rng(seed)
+	{
+		tDispatcher.SetRandomEngine(&Rng);
+		tTargetSelector.SetRandomEngine(&Rng);
+		auto listener = [&](Dispatcher* d, int time)
+		{
+			if (time == -1)
+			{
+				DispatcherErrorHandler(d);
+				return;
+			}
+		};
+		tDispatcher.SetListener(listener);
+		tDispatcher.SetActionHandler([this](Entity* e) { Act(e); });
+		tDispatcher.SetTimeHandler([this](int time) {
+			Timer.AdvanceTime(time, [this](int entity, size_t modifier) {
+				ExpireModifier(entity, modifier);
+			});
+		});
+	}
+	void AddName(const string& groupName, const string& name)
+	{
+		MemoryPoolScope scope(Pool.get());
+		AddAttribute(MakeContainer<GamerenaAttribute>(groupName, name));
+	}
+	// 以已生成的属性的副本加入实体
+	void AddAttribute(const GamerenaAttribute& attr)
+	{
+		MemoryPoolScope scope(Pool.get());
+		AddAttribute(ToContainer(attr.Clone()));
+	}
+	// 实体与其他实体(包括其他 Game 中的)共享 attr 而不复制, 例如由
+	// LoadRoster 并行生成的属性. 实体只以 const 持有属性, 调用者此后也不应
+	// 再修改它; 实体加上修饰器时才复制出自己的修饰后属性. 在多个线程的
+	// Game 之间共享的属性应分配在堆上, 而不是某个 Game 的内存池中.
+	void AddAttribute(const Container<GamerenaAttribute>& attr)
+	{
+		if (attr == nullptr)
+			throw NullArgumentException("attr can\'t be null.");
+		MemoryPoolScope scope(Pool.get());
+		auto entity = MakeContainer<Entity>(Container<const EntityAttribute>(attr), nullptr);
+		auto state = GetGamerenaState(*entity);
+		state->Id = Entities.size();
+		state->Owner = this;
+		Entities.push_back(entity);
+		DeathTimes.push_back(-1);
+		if (Stats) Stats->Bind(*entity);
+		Groups[attr->OriginGroupIndex].push_back(entity);
+		tDispatcher.AddEntity(entity);
+		tTargetSelector.AddEntity(entity);
+	}
+	// 启用列式属性存储, 适用于十万以上规模的场景; 可在加入实体前后调用
+	void UseStatStore()
+	{
+		if (Stats) return;
+		Stats = Container<StatStore>(new StatStore());
+		for (auto& entity : Entities)
+			Stats->Bind(*entity);
+		tDispatcher.SetStatStore(Stats.get());
+	}
+	StatStore* GetStatStore()
+	{
+		return Stats.get();
+	}
+	void Start()
+	{
+		while (Step());
+	}
+	// 同一时刻行动的实体一起结算. threads 为 0 (默认)时逐个行动; 不小于
+	// 1 时每次 Step 结算一个时刻, 结果只取决于是否启用而与线程数无关,
+	// threads 为 1 即是串行的参照实现:
+	// 1. 按出队顺序取出该时刻的所有行动者, 先处理到期的修饰器;
+	// 2. 每个行动者使用由本局随机数与自身编号派生的独立随机数序列, 依据时刻
+	//    开始时的局面选择技能, 目标, 下次行动时刻并预先掷骰(可并行);
+	// 3. 按出队顺序依次提交生命值, 死亡与得分. 行动者已被先提交的行动击杀
+	//    时放弃行动; 目标已死亡时行动落空(BattleEvent::Miss).
+	// 脚本技能无法预先掷骰, 在提交时直接执行.
+	void SetTickThreads(int threads)
+	{
+		TickThreads = max(threads, 0);
+		Workers = TickThreads > 1
+			? Container<WorkerPool>(new WorkerPool(TickThreads)) : nullptr;
+	}
+	int GetTickThreads()const
+	{
+		return TickThreads;
+	}
+	// 同一时刻结算中因行动者或目标已死亡而放弃或落空的行动数
+	uint64_t GetTickConflicts()const
+	{
+		return TickConflicts;
+	}
+	// 执行一次行动(或一个时刻的所有行动); 对局已结束时返回 false
+	bool Step()
+	{
+		if (IsDone()) return false;
+		if (TickThreads > 0) return StepTick();
+		MemoryPoolScope scope(Pool.get());
+		if (!tDispatcher.DispatchNext())
+			return true;
+		Timer.CompleteRound(GetGamerenaState(*GetLastEntity())->Id,
+			[this](int entity, size_t modifier) {
+				ExpireModifier(entity, modifier);
+			});
+		if (Replay) Replay->Record(*this);
+		return true;
+	}
+	// 为实体加上修饰器, 按修饰器的 MaxTime(时间)与 MaxRound(该实体的行动
+	// 次数)自动到期, 先满足的条件生效. 返回的编号可用于 RemoveModifier.
+	size_t AddModifier(Entity& entity, const EntityAttributeModifier& modifier)
+	{
+		PerfScope perf(PerfMetric::Modifier);
+		MemoryPoolScope scope(Pool.get());
+		GamerenaState& state = *GetGamerenaState(entity);
+		size_t id = state.AddModifier(&modifier);
+		if (modifier.MaxTime >= 0)
+			Timer.AddTimed(state.Id, id, GetCurrentTime() + modifier.MaxTime);
+		if (modifier.MaxRound >= 0)
+			Timer.AddRounds(state.Id, id, modifier.MaxRound);
+		Emit(BattleEvent::ModifierAdded, &entity, nullptr, id);
+		return id;
+	}
+	bool RemoveModifier(Entity& entity, size_t modifier)
+	{
+		return ExpireModifier(GetGamerenaState(entity)->Id, modifier);
+	}
+	// 把之后的每次行动记录到录像中
+	void SetReplayWriter(ReplayWriter* replay)
+	{
+		Replay = replay;
+		if (Replay) Replay->Begin(*this);
+	}
+	// 最近一次行动的实体
+	Entity* GetLastEntity()const
+	{
+		return tDispatcher.LastEntity();
+	}
+	RandomEngine& GetRandomEngine()
+	{
+		return Rng;
+	}
+	// 范围伤害的暂存区, 逐个行动与同刻结算共用
+	AreaDamageBatch& GetAreaBatch()
+	{
+		return AreaBatch;
+	}
+	// 本局的实体, 属性, 状态与修饰器都分配在这里, 随 Game 一起释放
+	MemoryPool* GetMemoryPool()const
+	{
+		return Pool.get();
+	}
+	// 本局的事件总线. 分批投递的事件在对局结束时一并交出
+	EventBus& GetEventBus()
+	{
+		return Events;
+	}
+	// 战斗过程(修饰器事件除外)以事件形式写入 log, 由事件总线逐个转交;
+	// 传入 nullptr 时退订
+	void SetEventLog(EventLog* log)
+	{
+		Events.Unsubscribe(LogSubscription);
+		LogSubscription = -1;
+		if (log == nullptr) return;
+		uint32_t types = EventBus::AllTypes
+			& ~EventBus::TypeBit(BattleEvent::ModifierAdded)
+			& ~EventBus::TypeBit(BattleEvent::ModifierExpired);
+		LogSubscription = Events.Subscribe(types,
+			[log](const BattleEvent* events, size_t count) {
+				for (size_t i = 0; i < count; ++i)
+					log->Push(events[i]);
+			});
+	}
+	bool IsNarrating()const
+	{
+		return LogSubscription >= 0;
+	}
+	// 实体的生命值降为 0 时由 GetDamage 经 NotifyDeath 调用: 记录死亡时刻,
+	// 并移出调度与目标选择
+	void RemoveDead(const GamerenaState& state)
+	{
+		DeathTimes[state.Id] = tDispatcher.GetCurrentTime();
+		tDispatcher.RemoveEntity(state.Id);
+		tTargetSelector.RemoveEntity(state.Id);
+	}
+	void Emit(uint8_t type, Entity* subject, Entity* other,
+		int value = 0, uint8_t detail = 0)
+	{
+		if (!Events.Wants(type)) return;
+		const GamerenaState& state = *GetGamerenaState(*subject);
+		BattleEvent e;
+		e.Type = type;
+		e.Detail = detail;
+		e.Active = state.IsActive();
+		e.Time = tDispatcher.GetCurrentTime();
+		e.Subject = state.Id;
+		e.Other = other ? GetGamerenaState(*other)->Id : -1;
+		e.Value = value;
+		e.HP = state.GetHP();
+		e.MaxHP = GetGamerenaStats(*subject).BaseHP;
+		Events.Publish(e);
+	}
+	int GetCurrentTime()const
+	{
+		return tDispatcher.GetCurrentTime();
+	}
+	size_t GetAliveCount()const
+	{
+		return count(DeathTimes.begin(), DeathTimes.end(), -1);
+	}
+	// 实体死亡的时刻; 仍存活时返回 -1
+	int GetDeathTime(int id)const
+	{
+		return DeathTimes[id];
+	}
+	// 结束时唯一存活的组; 无人存活时返回 false
+	bool GetWinner(Symbol& groupIndex)
+	{
+		auto& groups = tTargetSelector.GetActiveGroups();
+		if (groups.size() != 1)
+			return false;
+		groupIndex = tTargetSelector.GetGroupKey(groups.front());
+		return true;
+	}
+	using Group = List<Container<Entity>>;
+	// 以组名的 Symbol 为键
+	const HashMap<Symbol, Group>& GetGroups()const
+	{
+		return Groups;
+	}
+	const List<Container<Entity>>& GetEntities()const
+	{
+		return Entities;
+	}
+	// 与 entity 同组的存活实体编号. 实体死亡时会从中移除, 遍历时需先复制.
+	const List<int>& GetAliveTeam(const Entity& entity)const
+	{
+		return tTargetSelector.GetAliveMembers(GetGamerenaState(entity)->Id);
+	}
+	bool IsDone()
+	{
+		if (DoneFlag)
+			return true;
+		if (tTargetSelector.GroupsKeep() < 2)
+		{
+			DoneFlag = true;
+			Events.Flush();
+			return true;
+		}
+		return false;
+	}
+	// 保存当前局面, 可反复 Restore 以从同一局面展开多次模拟. 传入的
+	// snapshot 会复用其缓冲区.
+	void Snapshot(GameSnapshot& snapshot)const
+	{
+		MemoryPoolScope scope(Pool.get());
+		snapshot.Data.clear();
+		snapshot.Modifiers.clear();
+		SnapshotWriter writer(snapshot.Data);
+		writer.Put(Entities.size());
+		writer.Put(Stats != nullptr);
+		writer.Put(DoneFlag);
+		writer.Put(Rng.GetSeed());
+		writer.Put(Rng.GetCounter());
+		for (auto& entity : Entities)
+		{
+			const GamerenaState& state = *GetGamerenaState(*entity);
+			StateRecord{ state.HP, state.Score, state.NextActionTime,
+				state.Stage, state.Active, state.GetModifierCount() }.Save(writer);
+			if (state.GetModifierCount())
+				snapshot.Modifiers.push_back({ state.Id,
+					state.CloneModifiers(), state.GetModifierIds() });
+		}
+		writer.PutList(DeathTimes);
+		if (Stats)
+		{
+			for (auto column : { &Stats->HP, &Stats->MaxHP, &Stats->Attack,
+				&Stats->Defense, &Stats->Magic, &Stats->MagicDefense,
+				&Stats->Speed, &Stats->Accuracy, &Stats->Intelligence,
+				&Stats->Score, &Stats->NextActionTime })
+				writer.PutList(*column);
+			writer.PutList(Stats->Active);
+			writer.PutList(Stats->Dirty);
+		}
+		tDispatcher.Save(writer);
+		tTargetSelector.Save(writer);
+		Timer.Save(writer);
+	}
+	GameSnapshot Snapshot()const
+	{
+		GameSnapshot snapshot;
+		Snapshot(snapshot);
+		return snapshot;
+	}
+	// 恢复到 snapshot 所记录的局面; snapshot 必须来自本局
+	void Restore(const GameSnapshot& snapshot)
+	{
+		MemoryPoolScope scope(Pool.get());
+		SnapshotReader reader(snapshot.Data);
+		size_t entityCount;
+		bool useStats;
+		uint64_t seed, counter;
+		reader.Get(entityCount);
+		reader.Get(useStats);
+		if (entityCount != Entities.size() || useStats != (Stats != nullptr))
+			throw InvalidArgumentException("snapshot was taken from another game.");
+		reader.Get(DoneFlag);
+		reader.Get(seed);
+		reader.Get(counter);
+		Rng.SetSeed(seed);
+		Rng.SetCounter(counter);
+		auto modifiers = snapshot.Modifiers.begin();
+		for (auto& entity : Entities)
+		{
+			GamerenaState& state = *GetGamerenaState(*entity);
+			StateRecord record;
+			record.Load(reader);
+			state.HP = record.HP;
+			state.Score = record.Score;
+			state.NextActionTime = record.NextActionTime;
+			state.Stage = record.StageValue;
+			state.Active = record.Active;
+			if (record.ModifierCount)
+			{
+				state.SetModifiers(modifiers->Modifiers, modifiers->ModifierIds);
+				++modifiers;
+			}
+			else if (state.GetModifierCount())
+				state.SetModifiers({}, {});
+		}
+		reader.GetList(DeathTimes);
+		if (Stats)
+		{
+			for (auto column : { &Stats->HP, &Stats->MaxHP, &Stats->Attack,
+				&Stats->Defense, &Stats->Magic, &Stats->MagicDefense,
+				&Stats->Speed, &Stats->Accuracy, &Stats->Intelligence,
+				&Stats->Score, &Stats->NextActionTime })
+				reader.GetList(*column);
+			reader.GetList(Stats->Active);
+			reader.GetList(Stats->Dirty);
+		}
+		tDispatcher.Load(reader);
+		tTargetSelector.Load(reader);
+		Timer.Load(reader);
+	}
+	// 以 seed 重新开始同一份名单的对局: 各实体的状态按属性恢复, 调度与目标
+	// 选择的结构原地重建并保留已分配的空间, 结果与以 seed 构造并加入同样
+	// 实体的新对局完全相同.
+	void Reset(uint64_t seed)
+	{
+		MemoryPoolScope scope(Pool.get());
+		Events.Flush();
+		DoneFlag = false;
+		TickConflicts = 0;
+		Rng.SetSeed(seed);
+		for (auto& entity : Entities)
+		{
+			GamerenaState& state = *GetGamerenaState(*entity);
+			if (state.GetModifierCount())
+				state.SetModifiers({}, {});
+			// 没有修饰器时修饰后的属性即是原属性
+			ResetState(state,
+				*(const GamerenaAttribute*)entity->GetModifiedAttribute());
+			state.SetScore(0);
+			state.SetActive(true);
+			state.Stage = Stages.Waiting;
+		}
+		fill(DeathTimes.begin(), DeathTimes.end(), -1);
+		Timer.Clear();
+		tTargetSelector.Reset();
+		tDispatcher.Reset();
+	}
+	// 以原来的种子重赛
+	void Reset()
+	{
+		Reset(Rng.GetSeed());
+	}
+protected:
+	// 实体的一次行动: 按权重选择技能与目标并施放
+	void Act(Entity* e)
+	{
+		// 持有修饰后属性的引用, 技能改变修饰器时它仍然有效
+		Container<const EntityAttribute> iattr = e->GetSharedModifiedAttribute();
+		const SkillSelector& skills =
+			static_cast<const GamerenaAttribute&>(*iattr).tSkillSelector;
+		const SkillInfo* skill;
+		{
+			PerfScope perf(PerfMetric::SkillSelection);
+			skill = &skills.RandomSkill(Rng);
+		}
+		Entity* target = nullptr;
+		{
+			PerfScope perf(PerfMetric::TargetSelection);
+			switch (skill->TargetType)
+			{
+			case Targets.Enemy:
+			case Targets.EnemyGroup: // 随机选中的敌人所在的组
+				target = tTargetSelector.GetRandomTarget(e);
+				break;
+			case Targets.Teammate:
+				target = tTargetSelector.GetRandomTeammate(e);
+				break;
+			}
+		}
+		skills.Invoke(*skill, *this, e, target);
+	}
+	// 一个行动者在同一时刻结算中的计划
+	struct ActionPlan
+	{
+		int Actor;
+		int Target;
+		SkillInfo Skill;
+		SkillEffect Effect;
+		double Factor;
+		int NextTime;
+		int Amount; // 伤害(0 为闪避)或未截断的治疗量
+		GamerenaStats ActorStats;
+		GamerenaStats TargetStats;
+		Container<const EntityAttribute> Attribute; // 持有修饰后的属性(技能)
+		RandomEngine Rng;
+	};
+	bool StepTick()
+	{
+		MemoryPoolScope scope(Pool.get());
+		if (!tDispatcher.PopTick(TickActors))
+			return true;
+		// 本时刻的随机数; 每个时刻只消耗本局随机数序列中的一个数
+		RandomEngine tickRng = Rng.Split(Rng.Next());
+		size_t count = TickActors.size();
+		Plans.resize(count);
+		// 准备: 修饰后的属性是按需生成的缓存, 先在本线程生成
+		for (size_t i = 0; i < count; ++i)
+		{
+			ActionPlan& plan = Plans[i];
+			Entity& actor = *Entities[TickActors[i]];
+			plan.Actor = TickActors[i];
+			plan.Attribute = actor.GetSharedModifiedAttribute();
+			plan.ActorStats = GetGamerenaStats(actor);
+			plan.Rng = tickRng.Split(plan.Actor);
+		}
+		ForEachPlan([this](ActionPlan& plan) { PlanAction(plan); });
+		for (size_t i = 0; i < count; ++i)
+		{
+			ActionPlan& plan = Plans[i];
+			if (plan.Target >= 0 && plan.Skill.Id != SkillId::Scripted)
+				plan.TargetStats = GetGamerenaStats(*Entities[plan.Target]);
+		}
+		ForEachPlan([](ActionPlan& plan) { RollAction(plan); });
+		for (size_t i = 0; i < count; ++i)
+			CommitAction(Plans[i]);
+		for (auto& plan : Plans)
+			plan.Attribute = nullptr;
+		if (Replay) Replay->Record(*this);
+		return true;
+	}
+	void ForEachPlan(const Delegate<void(ActionPlan&)>& body)
+	{
+		// 行动者较少时并行的开销大于收益
+		const size_t MinParallel = 64;
+		if (Workers == nullptr || Plans.size() < MinParallel)
+		{
+			for (auto& plan : Plans)
+				body(plan);
+			return;
+		}
+		Workers->ParallelFor(Plans.size(), [&](size_t i) { body(Plans[i]); });
+	}
+	// 只读局面, 可并行
+	void PlanAction(ActionPlan& plan)const
+	{
+		Entity* actor = Entities[plan.Actor].get();
+		plan.NextTime = GetCurrentTime()
+			+ Dispatcher::RollWaitTime(plan.ActorStats.BaseSpeed, plan.Rng);
+		const SkillSelector& skills =
+			static_cast<const GamerenaAttribute&>(*plan.Attribute).tSkillSelector;
+		{
+			PerfScope perf(PerfMetric::SkillSelection);
+			plan.Skill = skills.RandomSkill(plan.Rng);
+		}
+		Entity* target = nullptr;
+		{
+			PerfScope perf(PerfMetric::TargetSelection);
+			switch (plan.Skill.TargetType)
+			{
+			case Targets.Enemy:
+			case Targets.EnemyGroup:
+				target = tTargetSelector.GetRandomTarget(actor, plan.Rng);
+				break;
+			case Targets.Teammate:
+				target = tTargetSelector.GetRandomTeammate(actor, plan.Rng);
+				break;
+			}
+		}
+		plan.Target = target ? GetGamerenaState(*target)->Id : -1;
+		switch (plan.Skill.Id)
+		{
+#define GAMERENA_SKILL_CASE(Name)                                     \
+		case SkillId::Name:                                           \
+			plan.Effect = SkillDescriptor<SkillId::Name>::Effect;     \
+			plan.Factor = SkillDescriptor<SkillId::Name>::Factor;     \
+			break;
+		GAMERENA_SKILL_CASE(BaseAttack)
+		GAMERENA_SKILL_CASE(BaseMagic)
+		GAMERENA_SKILL_CASE(FireBall)
+		GAMERENA_SKILL_CASE(Critical)
+		GAMERENA_SKILL_CASE(Cuel)
+		GAMERENA_SKILL_CASE(Meteor)
+#undef GAMERENA_SKILL_CASE
+		case SkillId::Scripted:
+			break;
+		}
+	}
+	static void RollAction(ActionPlan& plan);
+	void CommitAction(ActionPlan& plan);
+	// 移除后生命值不超过新的上限
+	bool ExpireModifier(int id, size_t modifier)
+	{
+		PerfScope perf(PerfMetric::Modifier);
+		Entity& entity = *Entities[id];
+		GamerenaState& state = *GetGamerenaState(entity);
+		if (!state.RemoveModifier(modifier))
+			return false;
+		state.SetHP(min(state.GetHP(), GetGamerenaStats(entity).BaseHP));
+		Emit(BattleEvent::ModifierExpired, &entity, nullptr, modifier);
+		return true;
+	}
+	void DispatcherErrorHandler(Dispatcher* d)
+	{
+		//TODO
+		DoneFlag = true;
+		Events.Flush();
+	}
+private:
+	Container<MemoryPool> Pool; // 最先构造, 最后释放
+	Container<WorkerPool> Workers = nullptr;
+	int TickThreads = 0;
+	uint64_t TickConflicts = 0;
+	List<int> TickActors;
+	List<ActionPlan> Plans;
+	AreaDamageBatch AreaBatch;
+	bool DoneFlag = false;
+	EventBus Events;
+	int LogSubscription = -1;
+	ReplayWriter* Replay = nullptr;
+	RandomEngine Rng;
+	Container<StatStore> Stats = nullptr;
+	Dispatcher tDispatcher;
+	TargetSelector tTargetSelector;
+	ModifierTimer Timer;
+	List<Container<Entity>> Entities;
+	List<int> DeathTimes;
+	HashMap<Symbol, Group> Groups;
+};
+
+void ShowObject(const Entity& e, int space, int level);
+
+// 掷骰与结算分开: Roll* 只读属性并消耗随机数, 可以并行执行; Apply* 按
+// 顺序修改状态. 伤害为 0 表示被闪避.
+int RollPhysicDamage(const GamerenaStats& pAttr, const GamerenaStats& tAttr,
+	RandomEngine& rng, double dmgFactor = 1.0)
+{
+	// 闪避判定
+	const int BaseDodgeChance = 16;
+	int dodgeChance = BaseDodgeChance
+		+ (tAttr.BaseAccuracy - pAttr.BaseAccuracy) / 4
+		+ (tAttr.BaseDefense - pAttr.BaseAttack) / 8;
+	if (rng.Random(100) < dodgeChance)
+		return 0;
+	const int BaseDamage = 15;
+	double roll[2];
+	rng.Fill(roll, 2);
+	return max(1,
+		(int)(BaseDamage
+			+ pAttr.BaseAttack * 0.3 + pAttr.BaseAttack * 0.9 * roll[0]
+			- tAttr.BaseDefense * 0.2 + tAttr.BaseDefense * 1.3 * roll[1]));
+}
+
+int RollMagicDamage(const GamerenaStats& pAttr, const GamerenaStats& tAttr,
+	RandomEngine& rng, double dmgFactor = 1.0)
+{
+	// 闪避判定
+	const int BaseDodgeChance = 25;
+	int dodgeChance = BaseDodgeChance
+		- pAttr.BaseIntelligence >> 3
+		+ (tAttr.BaseAccuracy - pAttr.BaseAccuracy) / 8
+		+ (tAttr.BaseMagicDefense - pAttr.BaseMagic) / 8;
+	if (rng.Random(100) < dodgeChance)
+		return 0;
 	const int BaseDamage = 25;
-	int damage = max(1,
+	double roll[2];
+	rng.Fill(roll, 2);
+	return max(1,
 		(int)(BaseDamage
-			+ pAttr.BaseMagic * 0.6 + pAttr.BaseMagic * 0.6 * Random()
-			- tAttr.BaseMagicDefense * 0.75 + tAttr.BaseMagicDefense * 0.75 * Random()
+			+ pAttr.BaseMagic * 0.6 + pAttr.BaseMagic * 0.6 * roll[0]
+			- tAttr.BaseMagicDefense * 0.75 + tAttr.BaseMagicDefense * 0.75 * roll[1]
 			+ pAttr.BaseIntelligence * 0.2));
-	cout << " 对 " << tAttr.GetName() << " 造成了 " << damage << "点魔法伤害.\n";
-	pState.Score += damage;
-	tState.GetDamage(damage);
-	ShowObject(*t, 4, 0);
-	if (tState.Active == false)
+}
+
+// 未按目标生命值上限截断的治疗量
+int RollHeal(const GamerenaStats& pAttr, RandomEngine& rng, double hFactor = 1.0)
+{
+	const int BaseHeal = 10;
+	return max(1,
+		(int)(BaseHeal
+			+ pAttr.BaseMagic * 0.25 + pAttr.BaseMagic * 0.35 * rng.Random()
+			+ pAttr.BaseIntelligence * 0.4));
+}
+
+// type: BattleEvent::Damage 或 BattleEvent::MagicDamage
+void ApplyDamage(Game& game, Entity* p, Entity* t, int damage, uint8_t type)
+{
+	GamerenaState& pState = *GetGamerenaState(*p);
+	GamerenaState& tState = *GetGamerenaState(*t);
+	if (damage == 0)
+	{
+		game.Emit(BattleEvent::Dodge, t, p);
+		return;
+	}
+	pState.AddScore(damage);
+	bool died = tState.GetDamage(damage);
+	game.Emit(type, t, p, damage);
+	if (died)
+	{
+		pState.AddScore(30);
+		game.Emit(BattleEvent::Death, t, p);
+	}
+}
+
+void ApplyHeal(Game& game, Entity* p, Entity* t, int heal, int maxHP)
+{
+	GamerenaState& pState = *GetGamerenaState(*p);
+	GamerenaState& tState = *GetGamerenaState(*t);
+	heal = min(maxHP - tState.GetHP(), heal);
+	pState.AddScore(heal);
+	tState.SetHP(tState.GetHP() + heal);
+	game.Emit(BattleEvent::Heal, t, p, heal);
+}
+
+void CausePhysicDamage(Game& game, Entity* p, Entity* t, double dmgFactor = 1.0)
+{
+	PerfScope perf(PerfMetric::Damage);
+	int damage = RollPhysicDamage(GetGamerenaStats(*p), GetGamerenaStats(*t),
+		game.GetRandomEngine(), dmgFactor);
+	ApplyDamage(game, p, t, damage, BattleEvent::Damage);
+}
+
+void CauseMagicDamage(Game& game, Entity* p, Entity* t, double dmgFactor = 1.0)
+{
+	PerfScope perf(PerfMetric::Damage);
+	int damage = RollMagicDamage(GetGamerenaStats(*p), GetGamerenaStats(*t),
+		game.GetRandomEngine(), dmgFactor);
+	ApplyDamage(game, p, t, damage, BattleEvent::MagicDamage);
+}
+
+void MakeCuel(Game& game, Entity* p, Entity* t, double hFactor = 1.0)
+{
+	PerfScope perf(PerfMetric::Damage); // 治疗也计入伤害结算
+	int heal = RollHeal(GetGamerenaStats(*p), game.GetRandomEngine(), hFactor);
+	ApplyHeal(game, p, t, heal, GetGamerenaStats(*t).BaseHP);
+}
+
+// 范围魔法伤害公式, 逐个目标计算. 与 RollMagicDamage 相同, 但智力按
+// 原意降低闪避率, 伤害再乘以 dmgFactor.
+void RollAreaMagicDamageScalar(const GamerenaStats& pAttr, const int* accuracy,
+	const int* magicDefense, const double* rolls, size_t n, double dmgFactor,
+	int* damage, size_t begin = 0)
+{
+	const int BaseDodgeChance = 25;
+	const int BaseDamage = 25;
+	const double pMagic = pAttr.BaseMagic * 0.6;
+	const double pIntelligence = pAttr.BaseIntelligence * 0.2;
+	for (size_t i = begin; i < n; ++i)
+	{
+		int dodgeChance = BaseDodgeChance - (pAttr.BaseIntelligence >> 3)
+			+ (accuracy[i] - pAttr.BaseAccuracy) / 8
+			+ (magicDefense[i] - pAttr.BaseMagic) / 8;
+		if (rolls[i] * 100 < dodgeChance)
+		{
+			damage[i] = 0;
+			continue;
+		}
+		const double tMagicDefense = magicDefense[i] * 0.75;
+		damage[i] = max(1, (int)((BaseDamage
+			+ pMagic + pMagic * rolls[n + i]
+			- tMagicDefense + tMagicDefense * rolls[2 * n + i]
+			+ pIntelligence) * dmgFactor));
+	}
+}
+
+#ifdef GAMERENA_SSE2
+// 带符号整数除以 8, 向零取整(与 C++ 的 / 相同)
+inline __m128i DivideBy8(__m128i x)
+{
+	__m128i bias = _mm_and_si128(_mm_srai_epi32(x, 31), _mm_set1_epi32(7));
+	return _mm_srai_epi32(_mm_add_epi32(x, bias), 3);
+}
+#endif
+
+// 与 RollAreaMagicDamageScalar 结果逐位相同; SSE2 下每次计算两个目标,
+// 运算顺序与标量版本一致, 因此浮点结果也一致
+void RollAreaMagicDamage(const GamerenaStats& pAttr, const int* accuracy,
+	const int* magicDefense, const double* rolls, size_t n, double dmgFactor,
+	int* damage)
+{
+	size_t i = 0;
+#ifdef GAMERENA_SSE2
+	const int BaseDodgeChance = 25;
+	const __m128i pAccuracy = _mm_set1_epi32(pAttr.BaseAccuracy);
+	const __m128i pMagicInt = _mm_set1_epi32(pAttr.BaseMagic);
+	const __m128i baseChance =
+		_mm_set1_epi32(BaseDodgeChance - (pAttr.BaseIntelligence >> 3));
+	const __m128d hundred = _mm_set1_pd(100);
+	const __m128d baseDamage = _mm_set1_pd(25);
+	const __m128d pMagic = _mm_set1_pd(pAttr.BaseMagic * 0.6);
+	const __m128d pIntelligence = _mm_set1_pd(pAttr.BaseIntelligence * 0.2);
+	const __m128d defenseFactor = _mm_set1_pd(0.75);
+	const __m128d factor = _mm_set1_pd(dmgFactor);
+	const __m128i one = _mm_set1_epi32(1);
+	for (; i + 2 <= n; i += 2)
+	{
+		__m128i tAccuracy = _mm_loadl_epi64((const __m128i*)(accuracy + i));
+		__m128i tMagicDefense = _mm_loadl_epi64((const __m128i*)(magicDefense + i));
+		__m128i chance = _mm_add_epi32(baseChance,
+			_mm_add_epi32(DivideBy8(_mm_sub_epi32(tAccuracy, pAccuracy)),
+				DivideBy8(_mm_sub_epi32(tMagicDefense, pMagicInt))));
+		__m128d dodged = _mm_cmplt_pd(
+			_mm_mul_pd(_mm_loadu_pd(rolls + i), hundred), _mm_cvtepi32_pd(chance));
+		__m128d defense = _mm_mul_pd(_mm_cvtepi32_pd(tMagicDefense), defenseFactor);
+		__m128d value = _mm_add_pd(baseDamage, pMagic);
+		value = _mm_add_pd(value, _mm_mul_pd(pMagic, _mm_loadu_pd(rolls + n + i)));
+		value = _mm_sub_pd(value, defense);
+		value = _mm_add_pd(value, _mm_mul_pd(defense, _mm_loadu_pd(rolls + 2 * n + i)));
+		value = _mm_add_pd(value, pIntelligence);
+		__m128i result = _mm_cvttpd_epi32(_mm_mul_pd(value, factor));
+		// max(1, result), 闪避的目标为 0
+		__m128i small = _mm_cmplt_epi32(result, one);
+		result = _mm_or_si128(_mm_and_si128(small, one), _mm_andnot_si128(small, result));
+		__m128i dodgedMask = _mm_shuffle_epi32(_mm_castpd_si128(dodged), _MM_SHUFFLE(3, 3, 2, 0));
+		result = _mm_andnot_si128(dodgedMask, result);
+		_mm_storel_epi64((__m128i*)(damage + i), result);
+	}
+#endif
+	RollAreaMagicDamageScalar(pAttr, accuracy, magicDefense, rolls, n, dmgFactor, damage, i);
+}
+
+// 对 t 所在组的全部存活者造成魔法伤害: 先收集目标属性, 一次取出全部随机
+// 数并批量计算, 最后一趟结算生命值与死亡
+void CauseAreaMagicDamage(Game& game, Entity* p, Entity* t, RandomEngine& rng,
+	double dmgFactor, AreaDamageBatch& batch)
+{
+	PerfScope perf(PerfMetric::Damage);
+	auto& entities = game.GetEntities();
+	batch.Clear();
+	// 结算中会有实体死亡并移出存活表, 所以先复制编号
+	for (int id : game.GetAliveTeam(*t))
+	{
+		GamerenaStats stats = GetGamerenaStats(*entities[id]);
+		batch.Ids.push_back(id);
+		batch.Accuracy.push_back(stats.BaseAccuracy);
+		batch.MagicDefense.push_back(stats.BaseMagicDefense);
+	}
+	size_t n = batch.Ids.size();
+	batch.Rolls.resize(3 * n);
+	batch.Damage.resize(n);
+	rng.Fill(batch.Rolls.data(), 3 * n);
+	RollAreaMagicDamage(GetGamerenaStats(*p), batch.Accuracy.data(),
+		batch.MagicDefense.data(), batch.Rolls.data(), n, dmgFactor, batch.Damage.data());
+	int score = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		Entity* target = entities[batch.Ids[i]].get();
+		int damage = batch.Damage[i];
+		if (damage == 0)
+		{
+			game.Emit(BattleEvent::Dodge, target, p);
+			continue;
+		}
+		GamerenaState& tState = *GetGamerenaState(*target);
+		score += damage;
+		bool died = tState.GetDamage(damage);
+		game.Emit(BattleEvent::MagicDamage, target, p, damage);
+		if (died)
+		{
+			score += 30;
+			game.Emit(BattleEvent::Death, target, p);
+		}
+	}
+	GetGamerenaState(*p)->AddScore(score);
+}
+
+void BaseAttack(Game& game, Entity* p, Entity* t)
+{
+	game.Emit(BattleEvent::Action, p, t, 0, 0);
+	CausePhysicDamage(game, p, t);
+}
+
+void BaseMagic(Game& game, Entity * p, Entity * t)
+{
+	game.Emit(BattleEvent::Action, p, t, 0, 1);
+	CauseMagicDamage(game, p, t);
+}
+
+void FireBall(Game& game, Entity* p, Entity* t)
+{
+	game.Emit(BattleEvent::Action, p, t, 0, 2);
+	CauseMagicDamage(game, p, t, 1.8);
+}
+
+void Critical(Game& game, Entity* p, Entity* t)
+{
+	game.Emit(BattleEvent::Action, p, t, 0, 3);
+	CausePhysicDamage(game, p, t, 2.15);
+}
+
+void Cuel(Game& game, Entity* p, Entity* t)
+{
+	game.Emit(BattleEvent::Action, p, t, 0, 4);
+	MakeCuel(game, p, t, 1.2);
+}
+
+void Meteor(Game& game, Entity* p, Entity* t)
+{
+	game.Emit(BattleEvent::Action, p, t, 0, 5);
+	CauseAreaMagicDamage(game, p, t, game.GetRandomEngine(),
+		SkillDescriptor<SkillId::Meteor>::Factor, game.GetAreaBatch());
+}
+
+void Game::RollAction(ActionPlan& plan)
+{
+	// 范围伤害的目标在提交时才确定
+	if (plan.Target < 0 || plan.Skill.Id == SkillId::Scripted
+		|| plan.Effect == SkillEffect::AreaMagicDamage)
+		return;
+	PerfScope perf(PerfMetric::Damage);
+	switch (plan.Effect)
+	{
+	case SkillEffect::PhysicDamage:
+		plan.Amount = RollPhysicDamage(plan.ActorStats, plan.TargetStats,
+			plan.Rng, plan.Factor);
+		break;
+	case SkillEffect::MagicDamage:
+		plan.Amount = RollMagicDamage(plan.ActorStats, plan.TargetStats,
+			plan.Rng, plan.Factor);
+		break;
+	case SkillEffect::Heal:
+		plan.Amount = RollHeal(plan.ActorStats, plan.Rng, plan.Factor);
+		break;
+	case SkillEffect::AreaMagicDamage:
+		break;
+	}
+}
+
+void Game::CommitAction(ActionPlan& plan)
+{
+	Entity* p = Entities[plan.Actor].get();
+	if (!GetGamerenaState(*p)->IsActive())
+	{
+		++TickConflicts;
+		return;
+	}
+	Entity* t = plan.Target >= 0 ? Entities[plan.Target].get() : nullptr;
+	if (plan.Skill.Id == SkillId::Scripted)
+	{ // 计划时选中的目标可能已在本时刻先前的提交中死亡
+		if (t != nullptr && !GetGamerenaState(*t)->IsActive())
+		{
+			++TickConflicts;
+			Emit(BattleEvent::Miss, p, t);
+		}
+		else
+			static_cast<const GamerenaAttribute&>(*plan.Attribute)
+				.tSkillSelector.Invoke(plan.Skill, *this, p, t);
+	}
+	else if (t != nullptr)
+	{
+		Emit(BattleEvent::Action, p, t, 0, (uint8_t)plan.Skill.Id);
+		if (plan.Effect == SkillEffect::AreaMagicDamage)
+		{ // 选中的敌人已死亡时仍命中其组内其他存活者
+			if (GetAliveTeam(*t).empty())
+			{
+				++TickConflicts;
+				Emit(BattleEvent::Miss, p, t);
+			}
+			else
+				CauseAreaMagicDamage(*this, p, t, plan.Rng, plan.Factor, AreaBatch);
+		}
+		else if (!GetGamerenaState(*t)->IsActive())
+		{
+			++TickConflicts;
+			Emit(BattleEvent::Miss, p, t);
+		}
+		else if (plan.Effect == SkillEffect::Heal) // 上限取提交时的值
+			ApplyHeal(*this, p, t, plan.Amount, GetGamerenaStats(*t).BaseHP);
+		else
+			ApplyDamage(*this, p, t, plan.Amount, plan.Effect == SkillEffect::PhysicDamage
+				? BattleEvent::Damage : BattleEvent::MagicDamage);
+	}
+	tDispatcher.Schedule(plan.Actor, plan.NextTime);
+	Timer.CompleteRound(plan.Actor, [this](int entity, size_t modifier) {
+		ExpireModifier(entity, modifier);
+	});
+}
+
+
+void SkillSelector::GenerateSkill(GamerenaAttribute* pAttr, RandomEngine& rng)
+{
+	GamerenaAttribute& attr = *pAttr;
+	int BaseAttackPriority =
+		250 + (attr.BaseAttack - attr.BaseMagic) * 4 * (0.5 + rng.Random());
+	int BaseMagicPriority =
+		250 + (attr.BaseMagic - attr.BaseAttack) * 4 * (0.5 + rng.Random());
+	int FireBallPriority =
+		50 + (attr.BaseIntelligence >> 1) + (attr.BaseMagic);
+	int CriticalPriority =
+		30 + (attr.BaseIntelligence >> 2) + (attr.BaseAttack >> 1)
+		+ (attr.BaseAccuracy >> 1);
+	int CuelPriority =
+		60 + (attr.BaseIntelligence >> 1) + (attr.BaseMagic >> 2);
+	AddSkill<SkillId::BaseAttack>(BaseAttackPriority);
+	AddSkill<SkillId::BaseMagic>(BaseMagicPriority);
+	if (FireBallPriority > 140)
+		AddSkill<SkillId::FireBall>(FireBallPriority);
+	if (CriticalPriority > 125)
+		AddSkill<SkillId::Critical>(CriticalPriority);
+	if (CuelPriority > 100)
+		AddSkill<SkillId::Cuel>(CuelPriority);
+	// 范围伤害只有智力与魔力都很高的角色才会使用
+	int MeteorPriority =
+		(attr.BaseIntelligence >> 1) + (attr.BaseMagic >> 1) - 60;
+	if (MeteorPriority > 25)
+		AddSkill<SkillId::Meteor>(MeteorPriority);
+}
+
+inline void SkillSelector::Invoke(const SkillInfo& skill, Game& game,
+	Entity* p, Entity* t)const
+{
+	switch (skill.Id)
+	{
+#define GAMERENA_SKILL_CASE(Name)                                     \
+	case SkillId::Name:                                               \
+		SkillDescriptor<SkillId::Name>::Invoke(game, p, t);           \
+		break;
+	GAMERENA_SKILL_CASE(BaseAttack)
+	GAMERENA_SKILL_CASE(BaseMagic)
+	GAMERENA_SKILL_CASE(FireBall)
+	GAMERENA_SKILL_CASE(Critical)
+	GAMERENA_SKILL_CASE(Cuel)
+	GAMERENA_SKILL_CASE(Meteor)
+#undef GAMERENA_SKILL_CASE
+	case SkillId::Scripted:
+		Scripts[skill.Script](game, p, t);
+		break;
+	}
+}
+
+inline void GamerenaModifier::ModifyState(IState* state)const
+{
+	GamerenaState* pState = dynamic_cast<GamerenaState*>(state);
+	if (pState == nullptr)
+		throw InvalidArgumentException(
+			"state can\'t be null and have type of \"EntityState\".");
+	GamerenaState& State = *pState;
+	State.SetHP(max(State.GetHP() + HPModifier, 0));
+}
+
+// 修饰后的属性: attr 已含非加法修饰器的作用, 再加上加法修饰器之和 delta,
+// 最后统一截断一次
+inline GamerenaStats ApplyModifierDelta(const GamerenaAttribute& attr,
+	const GamerenaStats& delta)
+{
+	return {
+		max(attr.BaseHP + delta.BaseHP, 1),
+		max(attr.BaseAttack + delta.BaseAttack, 0),
+		attr.BaseDefense + delta.BaseDefense,
+		max(attr.BaseMagic + delta.BaseMagic, 0),
+		attr.BaseMagicDefense + delta.BaseMagicDefense,
+		attr.BaseSpeed + delta.BaseSpeed,
+		max(attr.BaseAccuracy + delta.BaseAccuracy, 5),
+		max(attr.BaseIntelligence + delta.BaseIntelligence, 0) };
+}
+
+// 直接作用于一份属性时与单个修饰器经 ApplyModifierDelta 的结果相同
+inline void GamerenaModifier::Modify(IAttribute* attribute)const
+{
+	GamerenaAttribute* pAttribute =
+		dynamic_cast<GamerenaAttribute*>(attribute);
+	if (pAttribute == nullptr)
+		throw InvalidArgumentException(
+			"attribute can\'t be null and have type of \"EntityAttribute\".");
+	GamerenaAttribute& Attribute = *pAttribute;
+	GamerenaStats stats = ApplyModifierDelta(Attribute, { HPModifier,
+		AttackModifier, DefenseModifier, MagicModifier, MagicDefenseModifier,
+		SpeedModifier, AccuracyModifier, IntelligenceModifier });
+	Attribute.BaseHP = stats.BaseHP;
+	Attribute.BaseAttack = stats.BaseAttack;
+	Attribute.BaseDefense = stats.BaseDefense;
+	Attribute.BaseMagic = stats.BaseMagic;
+	Attribute.BaseMagicDefense = stats.BaseMagicDefense;
+	Attribute.BaseSpeed = stats.BaseSpeed;
+	Attribute.BaseAccuracy = stats.BaseAccuracy;
+	Attribute.BaseIntelligence = stats.BaseIntelligence;
+}
+
+void NotifyDeath(Game& game, const GamerenaState& state)
+{
+	game.RemoveDead(state);
+}
+
+inline void ResetState(GamerenaState& state, const GamerenaAttribute& attr)
+{
+	state.GroupIndex = attr.OriginGroupIndex;
+	state.SetHP(attr.BaseHP);
+}
+
+inline GamerenaState* GamerenaAttribute::CreateDefaultState()const
+{
+	auto state = new GamerenaState();
+	ResetState(*state, *this);
+	return state;
+}
+
+GamerenaStats GetGamerenaStats(const Entity& e)
+{
+	const GamerenaState& state = *GetGamerenaState(e);
+	if (state.Store)
+		return state.Store->GetStats(state.Id);
+	return ApplyModifierDelta(
+		*(const GamerenaAttribute*)e.GetModifiedAttribute(),
+		state.ModifierDelta);
+}
+
+void StatStore::Bind(Entity& entity)
+{
+	GamerenaState& state = *GetGamerenaState(entity);
+	if (state.Store != nullptr)
+		throw InvalidArgumentException("state has been bound to a StatStore.");
+	if (state.Id < 0)
+		throw InvalidArgumentException("entity has no id.");
+	size_t size = max(HP.size(), (size_t)state.Id + 1);
+	for (auto column : { &HP, &MaxHP, &Attack, &Defense, &Magic,
+		&MagicDefense, &Speed, &Accuracy, &Intelligence, &Score,
+		&NextActionTime, &Group })
+		column->resize(size);
+	Active.resize(size);
+	Dirty.resize(size);
+	Entities.resize(size);
+	int id = state.Id;
+	Entities[id] = &entity;
+	HP[id] = state.HP;
+	Active[id] = state.Active;
+	Score[id] = state.Score;
+	NextActionTime[id] = state.NextActionTime;
+	auto attr = (const GamerenaAttribute*)entity.GetModifiedAttribute();
+	Symbol key = attr->OriginGroupIndex;
+	if (GroupIndices.size() <= key)
+		GroupIndices.resize(key + 1, -1);
+	if (GroupIndices[key] < 0)
+	{
+		GroupIndices[key] = GroupKeys.size();
+		GroupKeys.push_back(key);
+	}
+	Group[id] = GroupIndices[key];
+	state.Store = this;
+	Refresh(id);
+}
+
+void StatStore::Refresh(int id)
+{
+	const Entity& entity = *Entities[id];
+	GamerenaStats stats = ApplyModifierDelta(
+		*(const GamerenaAttribute*)entity.GetModifiedAttribute(),
+		GetGamerenaState(entity)->ModifierDelta);
+	MaxHP[id] = stats.BaseHP;
+	Attack[id] = stats.BaseAttack;
+	Defense[id] = stats.BaseDefense;
+	Magic[id] = stats.BaseMagic;
+	MagicDefense[id] = stats.BaseMagicDefense;
+	Speed[id] = stats.BaseSpeed;
+	Accuracy[id] = stats.BaseAccuracy;
+	Intelligence[id] = stats.BaseIntelligence;
+	Dirty[id] = 0;
+}
+
+void PrintHPLine(ostream& out, const string& name, int hp, int maxHP, int space)
+{
+	for (int i = 0; i < space; ++i) out.put('\0');
+	out << "Name: " << name << "  "
+		<< "HP: " << hp << " / " << maxHP << "  <";
+	int b = (hp + 10) / 20;
+	for (int i = 0; i < b; ++i) out.put(2);
+	for (int i = b; i < (maxHP + 10) / 20; ++i) out.put(1);
+	out << ">\n";
+}
+
+void ShowObject(const Entity& e, int space, int level)
+{
+	const GamerenaState& state = *GetGamerenaState(e);
+	const GamerenaStats attr = GetGamerenaStats(e);
+	auto PrintSpace = [&](){
+		for (int i = 0; i < space; ++i) cout.put('\0');
+	};
+	PrintHPLine(cout, e.GetName(), state.GetHP(), attr.BaseHP, space);
+	if (level > 1)
+	{
+		PrintSpace();
+		cout << "Score: " << state.GetScore() << '\n';
+	}
+	if (!state.IsActive())
 	{
-		pState.Score += 30;
-		cout << tAttr.GetName() << " 死亡了, 凶手是 " << pAttr.GetName() << '\n';
+		PrintSpace();
+		cout << "+-| xD\n";
+		return;
+	}
+	if (level > 0)
+	{
+		PrintSpace();
+		cout << "Atk: " << attr.BaseAttack << "\tDef: " << attr.BaseDefense
+			 << "\t\tAcc: " << attr.BaseAccuracy << '\n';
+		PrintSpace();
+		cout << "Mag: " << attr.BaseMagic << "\tMagDef: " << attr.BaseMagicDefense
+			 << "\tSpd: " << attr.BaseSpeed << "\tInt: " << attr.BaseIntelligence
+			 << '\n';
 	}
 }
 
-void MakeCuel(Entity* p, Entity* t, double hFactor = 1.0)
+// 把战斗事件还原为文字战报, 运行在 EventLog 的消费线程上
+class BattleTextRenderer
 {
-	GamerenaState& pState = *GetGamerenaState(*p);
-	GamerenaState& tState = *GetGamerenaState(*t);
-	auto piAttr = p->GetModifiedAttribute();
-	auto tiAttr = t->GetModifiedAttribute();
-	GamerenaAttribute& pAttr = *(GamerenaAttribute*)piAttr.get();
-	GamerenaAttribute& tAttr = *(GamerenaAttribute*)tiAttr.get();
-	const int BaseHeal = 10;
-	int heal = max(1,
-		(int)(BaseHeal
-			+ pAttr.BaseMagic * 0.25 + pAttr.BaseMagic * 0.35 * Random()
-			+ pAttr.BaseIntelligence * 0.4));
-	heal = min(tAttr.BaseHP - tState.HP, heal);
-	pState.Score += heal;
-	tState.HP += heal;
-	cout << " " << tAttr.GetName() << " 恢复了 "<< heal << " 点生命值.\n";
-	ShowObject(*t, 4, 0);
+public:
+	BattleTextRenderer(Game& game, ostream& out) : Out(out)
+	{
+		for (auto& e : game.GetEntities())
+			Names.push_back(e->GetName());
+	}
+	void operator()(const BattleEvent& e)
+	{
+		PerfScope perf(PerfMetric::Output);
+		static const char* ActionTexts[] = {
+			"  发起了攻击,", "  使用法术攻击,", "  发射出火球,",
+			"  瞄准了目标的弱点攻击,", "  使用了治愈魔法,", "  召唤了流星火雨,"
+		};
+		switch (e.Type)
+		{
+		case BattleEvent::Action:
+			PrintHPLine(Out, Names[e.Subject], e.HP, e.MaxHP, 0);
+			if (!e.Active)
+				Out << "+-| xD\n";
+			Out << ActionTexts[e.Detail];
+			break;
+		case BattleEvent::Dodge:
+			Out << " 但 " << Names[e.Subject] << " 闪避了攻击.\n";
+			break;
+		case BattleEvent::Damage:
+		case BattleEvent::MagicDamage:
+			Out << " 对 " << Names[e.Subject] << " 造成了 " << e.Value
+				<< (e.Type == BattleEvent::Damage ? "点伤害.\n" : "点魔法伤害.\n");
+			PrintStatus(e);
+			break;
+		case BattleEvent::Heal:
+			Out << " " << Names[e.Subject] << " 恢复了 " << e.Value << " 点生命值.\n";
+			PrintStatus(e);
+			break;
+		case BattleEvent::Death:
+			Out << Names[e.Subject] << " 死亡了, 凶手是 " << Names[e.Other] << '\n';
+			break;
+		case BattleEvent::Miss:
+			Out << " 但 " << Names[e.Other] << " 已经倒下了.\n";
+			break;
+		}
+	}
+private:
+	void PrintStatus(const BattleEvent& e)
+	{
+		PrintHPLine(Out, Names[e.Subject], e.HP, e.MaxHP, 4);
+		if (!e.Active)
+		{
+			for (int i = 0; i < 4; ++i) Out.put('\0');
+			Out << "+-| xD\n";
+		}
+	}
+	ostream& Out;
+	List<string> Names;
+};
+
+// 只读映射整个文件; Windows 下退化为一次性读入内存
+class MappedFile
+{
+public:
+	explicit MappedFile(const string& path)
+	{
+#ifdef _WIN32
+		ifstream in(path, ios::binary);
+		if (!in)
+			throw InvalidArgumentException("can't open \"" + path + "\".");
+		Buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+		Data = Buffer.data();
+		Size = Buffer.size();
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw InvalidArgumentException("can't open \"" + path + "\".");
+		struct stat info;
+		if (fstat(fd, &info) != 0)
+		{
+			close(fd);
+			throw InvalidArgumentException("can't read \"" + path + "\".");
+		}
+		Size = info.st_size;
+		if (Size > 0)
+		{
+			void* data = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED)
+			{
+				close(fd);
+				throw InvalidArgumentException("can't map \"" + path + "\".");
+			}
+			Data = (const char*)data;
+		}
+		close(fd);
+#endif
+	}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile()
+	{
+#ifndef _WIN32
+		if (Data) munmap((void*)Data, Size);
+#endif
+	}
+	const char* GetData()const { return Data; }
+	size_t GetSize()const { return Size; }
+private:
+	const char* Data = nullptr;
+	size_t Size = 0;
+#ifdef _WIN32
+	List<char> Buffer;
+#endif
+};
+
+// 2: 加入 Meteor 技能(改变了同一名单生成的技能), 头部标志加入同刻结算位.
+// 旧版本的回放按现在的规则重演会得到另一场战斗, 因此不再接受
+const uint32_t ReplayVersion = 2;
+
+void PutVarint(List<char>& data, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		data.push_back(char(value | 0x80));
+		value >>= 7;
+	}
+	data.push_back(char(value));
+}
+
+// 关键帧中的修饰器: 记录数(varint), 每条记录为实体编号(varint), 修饰器数
+// (varint), 每个修饰器为编号(varint), 类型(u8), 名字(varint 长度 + 字节),
+// RoundCount, TimeCount, MaxRound, MaxTime(i32); GamerenaModifier 之后还有
+// 各项属性的增量(8 个 i32). 修饰器是多态对象, 只能写入确切类型为
+// EntityAttributeModifier 或 GamerenaModifier 的修饰器(它们只有数据成员);
+// 遇到其他类型时返回 false, 不写入任何内容.
+enum class ModifierKind : uint8_t { Entity, Gamerena };
+
+bool PutModifiers(List<char>& data,
+	const List<GameSnapshot::ModifierRecord>& records)
+{
+	for (auto& record : records)
+		for (auto& modifier : record.Modifiers)
+			if (typeid(*modifier) != typeid(EntityAttributeModifier)
+				&& typeid(*modifier) != typeid(GamerenaModifier))
+				return false;
+	SnapshotWriter writer(data);
+	PutVarint(data, records.size());
+	for (auto& record : records)
+	{
+		PutVarint(data, record.Id);
+		PutVarint(data, record.Modifiers.size());
+		for (size_t i = 0; i < record.Modifiers.size(); ++i)
+		{
+			const IModifier& modifier = *record.Modifiers[i];
+			auto gamerena = dynamic_cast<const GamerenaModifier*>(&modifier);
+			PutVarint(data, record.ModifierIds[i]);
+			writer.Put(gamerena ? ModifierKind::Gamerena : ModifierKind::Entity);
+			const string& name = modifier.GetName();
+			PutVarint(data, name.size());
+			writer.PutArray(name.data(), name.size());
+			for (int value : { modifier.RoundCount, modifier.TimeCount,
+				modifier.MaxRound, modifier.MaxTime })
+				writer.Put(value);
+			if (gamerena)
+				for (int value : { gamerena->HPModifier, gamerena->AttackModifier,
+					gamerena->DefenseModifier, gamerena->MagicModifier,
+					gamerena->MagicDefenseModifier, gamerena->SpeedModifier,
+					gamerena->AccuracyModifier, gamerena->IntelligenceModifier })
+					writer.Put(value);
+		}
+	}
+	return true;
+}
+
+// 读取时以名字重建修饰器: SetName 是受保护的, 由这个子类设置, Clone 复制
+// 出的是 Base 本身
+template <class Base>
+struct RestoredModifier : public Base
+{
+	explicit RestoredModifier(const string& name)
+	{
+		this->SetName(name);
+	}
+};
+
+ReplayWriter::ReplayWriter(const string& path, const Roster& roster,
+	uint64_t seed, bool useStatStore, uint64_t keyframeInterval, bool tickMode) :
+	Out(path, ios::binary | ios::trunc),
+	Interval(max<uint64_t>(keyframeInterval, 1))
+{
+	if (!Out)
+		throw ReplayException("can't open \"" + path + "\" for writing.");
+	SnapshotWriter writer(Buffer);
+	writer.PutArray("GRPL", 4);
+	writer.Put(ReplayVersion);
+	writer.Put(seed);
+	writer.Put(uint8_t(useStatStore | tickMode << 1));
+	PutVarint(Buffer, roster.size());
+	for (auto& entry : roster)
+		for (auto str : { &entry.first, &entry.second })
+		{
+			PutVarint(Buffer, str->size());
+			writer.PutArray(str->data(), str->size());
+		}
+}
+
+void ReplayWriter::Begin(const Game& game)
+{
+	if (Closed || !Keyframes.empty())
+		throw UnexceptedCallException("replay has been started.");
+	LastTime = game.GetCurrentTime();
+	WriteKeyframe(game);
+	if (Keyframes.empty())
+		throw ReplayException("modifiers of this type can't be recorded in a keyframe.");
+}
+
+void ReplayWriter::Record(const Game& game)
+{
+	if (Closed) return;
+	int time = game.GetCurrentTime();
+	PutVarint(Buffer, uint64_t(time - LastTime) << 1);
+	PutVarint(Buffer, GetGamerenaState(*game.GetLastEntity())->Id);
+	LastTime = time;
+	if (++EventCount % Interval == 0)
+		WriteKeyframe(game);
+	Flush();
+}
+
+// 局面中有无法写入的修饰器时不生成关键帧(计入 SkippedKeyframes), 定位时
+// 从更早的关键帧模拟过来
+void ReplayWriter::WriteKeyframe(const Game& game)
+{
+	game.Snapshot(Snapshot);
+	KeyframeModifiers.clear();
+	if (!PutModifiers(KeyframeModifiers, Snapshot.Modifiers))
+	{
+		++SkippedKeyframes;
+		return;
+	}
+	Keyframes.push_back({ LastTime, EventCount, Written + Buffer.size() });
+	List<char> dataSize;
+	PutVarint(dataSize, Snapshot.Data.size());
+	PutVarint(Buffer, (dataSize.size() + Snapshot.Data.size()
+		+ KeyframeModifiers.size()) << 1 | 1);
+	Buffer.insert(Buffer.end(), dataSize.begin(), dataSize.end());
+	Buffer.insert(Buffer.end(), Snapshot.Data.begin(), Snapshot.Data.end());
+	Buffer.insert(Buffer.end(), KeyframeModifiers.begin(), KeyframeModifiers.end());
+}
+
+void ReplayWriter::Flush()
+{
+	const size_t FlushSize = 1 << 16;
+	if (Buffer.size() < FlushSize && !Closed) return;
+	Out.write(Buffer.data(), Buffer.size());
+	Written += Buffer.size();
+	Buffer.clear();
+}
+
+void ReplayWriter::Close()
+{
+	if (Closed) return;
+	Closed = true;
+	SnapshotWriter writer(Buffer);
+	uint64_t indexOffset = Written + Buffer.size();
+	for (auto& keyframe : Keyframes)
+	{ // 逐个字段写入, 不写出结构中的填充字节
+		writer.Put(keyframe.Time);
+		writer.Put(keyframe.EventIndex);
+		writer.Put(keyframe.Offset);
+	}
+	writer.Put(indexOffset);
+	writer.Put((uint64_t)Keyframes.size());
+	writer.Put(EventCount);
+	writer.Put(LastTime);
+	writer.PutArray("GRPI", 4);
+	Flush();
+	Out.close();
+}
+
+// 以内存映射方式读取录像, 打开时只解析文件头与索引. Seek 从不晚于目标
+// 时刻的最近关键帧恢复, 再按记录模拟到目标时刻, 并核对每次行动.
+class ReplayReader
+{
+public:
+	explicit ReplayReader(const string& path) : File(path)
+	{
+		Data = (const unsigned char*)File.GetData();
+		Size = File.GetSize();
+		if (Size == 0)
+			throw ReplayException("\"" + path + "\" is empty.");
+		size_t pos = 0;
+		char magic[4];
+		uint32_t version;
+		uint8_t flags;
+		ReadFixed(pos, magic);
+		if (memcmp(magic, "GRPL", 4) != 0)
+			throw ReplayException("\"" + path + "\" is not a replay file.");
+		ReadFixed(pos, version);
+		if (version != ReplayVersion)
+			throw ReplayException("unsupported replay version.");
+		ReadFixed(pos, Seed);
+		ReadFixed(pos, flags);
+		UseStatStore = (flags & 1) != 0;
+		TickMode = (flags & 2) != 0;
+		tRoster.resize(ReadVarint(pos));
+		for (auto& entry : tRoster)
+			for (auto str : { &entry.first, &entry.second })
+			{
+				size_t length = ReadVarint(pos);
+				if (pos + length > Size)
+					throw ReplayException("replay file is truncated.");
+				str->assign((const char*)Data + pos, length);
+				pos += length;
+			}
+		const size_t FooterSize = 8 + 8 + 8 + 4 + 4;
+		if (Size < pos + FooterSize)
+			throw ReplayException("replay file is truncated.");
+		size_t footer = Size - FooterSize;
+		uint64_t indexOffset, keyframeCount;
+		ReadFixed(footer, indexOffset);
+		ReadFixed(footer, keyframeCount);
+		ReadFixed(footer, EventCount);
+		ReadFixed(footer, EndTime);
+		ReadFixed(footer, magic);
+		const size_t KeyframeSize = 4 + 8 + 8;
+		if (memcmp(magic, "GRPI", 4) != 0 || keyframeCount == 0
+			|| indexOffset > Size - FooterSize
+			|| keyframeCount > (Size - FooterSize - indexOffset) / KeyframeSize)
+			throw ReplayException("replay file is damaged or unfinished.");
+		Keyframes.resize(keyframeCount);
+		size_t index = indexOffset;
+		for (auto& keyframe : Keyframes)
+		{
+			ReadFixed(index, keyframe.Time);
+			ReadFixed(index, keyframe.EventIndex);
+			ReadFixed(index, keyframe.Offset);
+		}
+	}
+	ReplayReader(const ReplayReader&) = delete;
+	ReplayReader& operator=(const ReplayReader&) = delete;
+	const Roster& GetRoster()const
+	{
+		return tRoster;
+	}
+	uint64_t GetSeed()const { return Seed; }
+	uint64_t GetEventCount()const { return EventCount; }
+	int GetEndTime()const { return EndTime; }
+	// 定位到时刻 time: 所有不晚于 time 的行动都已执行
+	Game& Seek(int time)
+	{
+		auto iter = upper_bound(Keyframes.begin(), Keyframes.end(), time,
+			[](int t, const ReplayKeyframe& k) { return t < k.Time; });
+		const ReplayKeyframe& keyframe =
+			iter == Keyframes.begin() ? Keyframes.front() : *(iter - 1);
+		if (tGame == nullptr || EventIndex < keyframe.EventIndex || Time > time)
+			LoadKeyframe(keyframe);
+		while (EventIndex < EventCount)
+		{
+			size_t pos = Position;
+			int nextTime, id;
+			ReadEvent(pos, nextTime, id);
+			if (nextTime > time) break;
+			if (!tGame->Step() || tGame->GetCurrentTime() != nextTime
+				|| GetGamerenaState(*tGame->GetLastEntity())->Id != id)
+				throw ReplayException("replay diverged from the simulation.");
+			Position = pos;
+			Time = nextTime;
+			++EventIndex;
+		}
+		return *tGame;
+	}
+	Game& GetGame()
+	{
+		if (tGame == nullptr)
+			LoadKeyframe(Keyframes.front());
+		return *tGame;
+	}
+private:
+	template <class T>
+	void ReadFixed(size_t& pos, T& value)const
+	{
+		if (pos + sizeof(T) > Size)
+			throw ReplayException("replay file is truncated.");
+		memcpy(&value, Data + pos, sizeof(T));
+		pos += sizeof(T);
+	}
+	uint64_t ReadVarint(size_t& pos)const
+	{
+		uint64_t value = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			if (pos >= Size)
+				throw ReplayException("replay file is truncated.");
+			unsigned char byte = Data[pos++];
+			value |= uint64_t(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+				return value;
+		}
+		throw ReplayException("replay file is damaged.");
+	}
+	// 读取 PutModifiers 写入的修饰器
+	void ReadModifiers(size_t& pos, List<GameSnapshot::ModifierRecord>& records)const
+	{
+		records.resize(ReadVarint(pos));
+		string name;
+		for (auto& record : records)
+		{
+			record.Id = (int)ReadVarint(pos);
+			size_t count = ReadVarint(pos);
+			record.Modifiers.resize(count);
+			record.ModifierIds.resize(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				record.ModifierIds[i] = ReadVarint(pos);
+				ModifierKind kind;
+				ReadFixed(pos, kind);
+				size_t length = ReadVarint(pos);
+				if (pos + length > Size)
+					throw ReplayException("replay file is truncated.");
+				name.assign((const char*)Data + pos, length);
+				pos += length;
+				IModifier* modifier;
+				if (kind == ModifierKind::Gamerena)
+					modifier = RestoredModifier<GamerenaModifier>(name).Clone();
+				else if (kind == ModifierKind::Entity)
+					modifier = RestoredModifier<EntityAttributeModifier>(name).Clone();
+				else
+					throw ReplayException("replay keyframe is damaged.");
+				record.Modifiers[i] = ToContainer(modifier);
+				for (int* value : { &modifier->RoundCount, &modifier->TimeCount,
+					&modifier->MaxRound, &modifier->MaxTime })
+					ReadFixed(pos, *value);
+				if (kind != ModifierKind::Gamerena)
+					continue;
+				auto m = static_cast<GamerenaModifier*>(modifier);
+				for (int* value : { &m->HPModifier, &m->AttackModifier,
+					&m->DefenseModifier, &m->MagicModifier, &m->MagicDefenseModifier,
+					&m->SpeedModifier, &m->AccuracyModifier, &m->IntelligenceModifier })
+					ReadFixed(pos, *value);
+			}
+		}
+	}
+	// 读取下一次行动, 跳过其间的关键帧
+	void ReadEvent(size_t& pos, int& time, int& id)const
+	{
+		uint64_t v;
+		while ((v = ReadVarint(pos)) & 1)
+			pos += v >> 1;
+		time = Time + int(v >> 1);
+		id = (int)ReadVarint(pos);
+	}
+	void LoadKeyframe(const ReplayKeyframe& keyframe)
+	{
+		if (tGame == nullptr)
+		{
+			tGame = Container<Game>(new Game(Seed));
+			if (UseStatStore) tGame->UseStatStore();
+			if (TickMode) tGame->SetTickThreads(1);
+			for (auto& entry : tRoster)
+				tGame->AddName(entry.first, entry.second);
+		}
+		size_t pos = keyframe.Offset;
+		uint64_t v = ReadVarint(pos);
+		size_t end = pos + (v >> 1);
+		if ((v & 1) == 0 || end > Size)
+			throw ReplayException("replay keyframe is damaged.");
+		size_t length = ReadVarint(pos);
+		if (pos + length > end)
+			throw ReplayException("replay keyframe is damaged.");
+		Snapshot.Data.assign(Data + pos, Data + pos + length);
+		pos += length;
+		ReadModifiers(pos, Snapshot.Modifiers);
+		if (pos != end)
+			throw ReplayException("replay keyframe is damaged.");
+		tGame->Restore(Snapshot);
+		Position = end;
+		EventIndex = keyframe.EventIndex;
+		Time = keyframe.Time;
+	}
+	MappedFile File;
+	const unsigned char* Data = nullptr;
+	size_t Size = 0;
+	uint64_t Seed;
+	bool UseStatStore;
+	bool TickMode;
+	Roster tRoster;
+	List<ReplayKeyframe> Keyframes;
+	uint64_t EventCount;
+	int EndTime;
+	Container<Game> tGame = nullptr;
+	GameSnapshot Snapshot;
+	size_t Position = 0;
+	uint64_t EventIndex = 0;
+	int Time = 0;
+};
+
+// 批量模拟的汇总结果; 组与实体按名单中首次出现的顺序排列
+struct SimulationReport
+{
+	static const int ScoreBucket = 50;
+	struct EntityResult
+	{
+		string Name;
+		int GroupIndex;
+		double SurvivalTimeSum = 0;
+		double ScoreSum = 0;
+		double ScoreSquareSum = 0;
+		int MinScore = INT_MAX;
+		int MaxScore = INT_MIN;
+		List<int> ScoreHistogram; // 每 ScoreBucket 分一档
+		void AddScore(int score)
+		{
+			ScoreSum += score;
+			ScoreSquareSum += (double)score * score;
+			MinScore = min(MinScore, score);
+			MaxScore = max(MaxScore, score);
+			size_t bucket = max(score, 0) / ScoreBucket;
+			if (ScoreHistogram.size() <= bucket)
+				ScoreHistogram.resize(bucket + 1);
+			++ScoreHistogram[bucket];
+		}
+		// 由直方图估计的分位数(所在档的下界)
+		int ScorePercentile(double q)const
+		{
+			int total = 0;
+			for (int count : ScoreHistogram) total += count;
+			int seen = 0;
+			for (size_t i = 0; i < ScoreHistogram.size(); ++i)
+			{
+				seen += ScoreHistogram[i];
+				if (seen > 0 && seen >= q * total)
+					return i * ScoreBucket;
+			}
+			return 0;
+		}
+	};
+	void Merge(const SimulationReport& other)
+	{
+		Games += other.Games;
+		Draws += other.Draws;
+		for (size_t i = 0; i < GroupWins.size(); ++i)
+			GroupWins[i] += other.GroupWins[i];
+		for (size_t i = 0; i < Entities.size(); ++i)
+		{
+			EntityResult& lhs = Entities[i];
+			const EntityResult& rhs = other.Entities[i];
+			lhs.SurvivalTimeSum += rhs.SurvivalTimeSum;
+			lhs.ScoreSum += rhs.ScoreSum;
+			lhs.ScoreSquareSum += rhs.ScoreSquareSum;
+			lhs.MinScore = min(lhs.MinScore, rhs.MinScore);
+			lhs.MaxScore = max(lhs.MaxScore, rhs.MaxScore);
+			if (lhs.ScoreHistogram.size() < rhs.ScoreHistogram.size())
+				lhs.ScoreHistogram.resize(rhs.ScoreHistogram.size());
+			for (size_t j = 0; j < rhs.ScoreHistogram.size(); ++j)
+				lhs.ScoreHistogram[j] += rhs.ScoreHistogram[j];
+		}
+	}
+	void Print(ostream& out)const;
+	// 只保存计数部分, 组名与实体名由双方的名单给出
+	void Save(SnapshotWriter& writer)const
+	{
+		writer.Put(Games);
+		writer.Put(Draws);
+		writer.PutList(GroupWins);
+		writer.Put(Entities.size());
+		for (auto& e : Entities)
+		{
+			writer.Put(e.SurvivalTimeSum);
+			writer.Put(e.ScoreSum);
+			writer.Put(e.ScoreSquareSum);
+			writer.Put(e.MinScore);
+			writer.Put(e.MaxScore);
+			writer.PutList(e.ScoreHistogram);
+		}
+	}
+	void Load(SnapshotReader& reader)
+	{
+		size_t entities;
+		reader.Get(Games);
+		reader.Get(Draws);
+		reader.GetList(GroupWins);
+		reader.Get(entities);
+		if (entities != Entities.size() || GroupWins.size() != GroupNames.size())
+			throw InvalidArgumentException("report was made from another roster.");
+		for (auto& e : Entities)
+		{
+			reader.Get(e.SurvivalTimeSum);
+			reader.Get(e.ScoreSum);
+			reader.Get(e.ScoreSquareSum);
+			reader.Get(e.MinScore);
+			reader.Get(e.MaxScore);
+			reader.GetList(e.ScoreHistogram);
+		}
+	}
+	int Games = 0;
+	int Draws = 0;
+	int Threads = 0;
+	double Seconds = 0;
+	List<string> GroupNames;
+	List<int> GroupWins;
+	List<EntityResult> Entities;
+};
+
+void SimulationReport::Print(ostream& out)const
+{
+	out << "Games: " << Games << "  Threads: " << Threads
+		<< "  Time: " << Seconds << "s";
+	if (Seconds > 0)
+		out << "  Games/s: " << Games / Seconds;
+	out << '\n';
+	for (size_t g = 0; g < GroupNames.size(); ++g)
+	{
+		out << "GroupName: " << GroupNames[g] << "  WinRate: "
+			<< (Games ? 100.0 * GroupWins[g] / Games : 0) << "%\n";
+		for (auto& e : Entities)
+		{
+			if (e.GroupIndex != (int)g) continue;
+			double mean = Games ? e.ScoreSum / Games : 0;
+			double var = Games ? e.ScoreSquareSum / Games - mean * mean : 0;
+			out << "    Name: " << e.Name
+				<< "  Survival: " << (Games ? e.SurvivalTimeSum / Games : 0)
+				<< "  Score: " << mean << " +- " << sqrt(max(var, 0.0))
+				<< " [" << e.MinScore << ", " << e.MaxScore << "]"
+				<< "  P10/P50/P90: " << e.ScorePercentile(0.1) << '/'
+				<< e.ScorePercentile(0.5) << '/' << e.ScorePercentile(0.9)
+				<< '\n';
+		}
+	}
+	out << "Draws: " << Draws << '\n';
+}
+
+// 为名单并行生成属性. 属性只由组名与名字决定(每个名字有自己的随机数
+// 生成器), 所以结果与逐个调用 Game::AddName 完全相同.
+List<Container<GamerenaAttribute>> BuildAttributes(const Roster& roster, int threads = 0)
+{
+	List<Container<GamerenaAttribute>> attributes(roster.size());
+	if (threads <= 0)
+		threads = max(1u, thread::hardware_concurrency());
+	threads = max(1, min<int>(threads, roster.size()));
+	atomic<size_t> next(0);
+	const size_t Batch = 256;
+	auto work = [&]()
+	{
+		// 每批的名字一次登记, 避免每个名字都争用符号表的锁
+		List<const string*> names;
+		List<Symbol> symbols;
+		for (size_t begin; (begin = next.fetch_add(Batch)) < roster.size();)
+		{
+			size_t end = min(begin + Batch, roster.size());
+			names.clear();
+			for (size_t i = begin; i < end; ++i)
+			{
+				names.push_back(&roster[i].second);
+				names.push_back(&roster[i].first);
+			}
+			SymbolTable::Global().Intern(names, symbols);
+			for (size_t i = begin; i < end; ++i)
+				attributes[i] = Container<GamerenaAttribute>(new GamerenaAttribute(
+					symbols[(i - begin) * 2 + 1], symbols[(i - begin) * 2]));
+		}
+	};
+	List<thread> workers;
+	for (int i = 1; i < threads; ++i)
+		workers.emplace_back(work);
+	work();
+	for (auto& worker : workers)
+		worker.join();
+	return attributes;
 }
 
-void BaseAttack(Entity* p, Entity* t)
+// 无输出的批量模拟: 同一名单独立运行多局, 分摊到多个线程并汇总结果
+class Simulator
+{
+public:
+	explicit Simulator(const Roster& roster, size_t seed = 0) :
+		Simulator(roster, BuildAttributes(roster), seed)
+	{
+	}
+	// attributes 与 roster 一一对应, 每局直接复用而不必重新生成
+	Simulator(const Roster& roster,
+		List<Container<GamerenaAttribute>> attributes, size_t seed = 0) :
+		tRoster(roster), Attributes(move(attributes)), Seed(seed)
+	{
+		if (Attributes.size() != tRoster.size())
+			throw InvalidArgumentException("attributes don't match roster.");
+		for (auto& entry : tRoster)
+		{
+			Symbol key = SymbolTable::Global().Intern(entry.first);
+			if (GroupIndices.size() <= key)
+				GroupIndices.resize(key + 1, -1);
+			if (GroupIndices[key] < 0)
+			{
+				GroupIndices[key] = GroupNames.size();
+				GroupNames.push_back(entry.first);
+			}
+		}
+	}
+	SimulationReport Run(int games, int threads = 0)
+	{
+		if (threads <= 0)
+			threads = max(1u, thread::hardware_concurrency());
+		threads = max(1, min(threads, games));
+		auto begin = chrono::steady_clock::now();
+		List<SimulationReport> reports(threads, EmptyReport());
+		atomic<int> next(0);
+		List<thread> workers;
+		for (int i = 0; i < threads; ++i)
+		{
+			workers.emplace_back([&, i]()
+				{
+					Container<Game> game;
+					for (int n; (n = next++) < games;)
+						RunOne(n, reports[i], game);
+				});
+		}
+		for (auto& worker : workers)
+			worker.join();
+		SimulationReport result = EmptyReport();
+		for (auto& report : reports)
+			result.Merge(report);
+		result.Threads = threads;
+		result.Seconds = chrono::duration<double>(
+			chrono::steady_clock::now() - begin).count();
+		return result;
+	}
+	// 在当前线程运行第 [first, first + count) 局; 同一局总是得到同样的结果,
+	// 因此可以任意切分后合并
+	SimulationReport RunRange(int first, int count)const
+	{
+		SimulationReport report = EmptyReport();
+		Container<Game> game;
+		for (int n = first; n < first + count; ++n)
+			RunOne(n, report, game);
+		return report;
+	}
+	SimulationReport EmptyReport()const
+	{
+		SimulationReport report;
+		report.GroupNames = GroupNames;
+		report.GroupWins.resize(GroupNames.size());
+		for (auto& entry : tRoster)
+		{
+			SimulationReport::EntityResult result;
+			result.Name = entry.second;
+			result.GroupIndex =
+				GroupIndices[SymbolTable::Global().Intern(entry.first)];
+			report.Entities.push_back(result);
+		}
+		return report;
+	}
+private:
+	// game 为空时建立对局, 之后的每局都 Reset 后重赛
+	void RunOne(int n, SimulationReport& report, Container<Game>& pGame)const
+	{
+		const size_t SeedF = 2654435761u;
+		if (pGame == nullptr)
+		{
+			pGame = Container<Game>(new Game(Seed + n * SeedF));
+			for (auto& attr : Attributes)
+				pGame->AddAttribute(attr);
+		}
+		else
+			pGame->Reset(Seed + n * SeedF);
+		Game& game = *pGame;
+		game.Start();
+		++report.Games;
+		Symbol winner;
+		if (game.GetWinner(winner))
+			++report.GroupWins[GroupIndices[winner]];
+		else
+			++report.Draws;
+		auto& entities = game.GetEntities();
+		for (size_t i = 0; i < entities.size(); ++i)
+		{
+			int deathTime = game.GetDeathTime(i);
+			auto& result = report.Entities[i];
+			result.SurvivalTimeSum +=
+				deathTime < 0 ? game.GetCurrentTime() : deathTime;
+			result.AddScore(GetGamerenaState(*entities[i])->GetScore());
+		}
+	}
+	Roster tRoster;
+	List<Container<GamerenaAttribute>> Attributes;
+	size_t Seed;
+	List<int> GroupIndices; // 以组名的 Symbol 为下标
+	List<string> GroupNames;
+};
+
+// 胜率估计的结果, 区间为各组胜率的置信区间
+struct WinEstimate
+{
+	struct GroupResult
+	{
+		string Name;
+		int Wins = 0;
+		double Probability = 0;
+		double Lower = 0;
+		double Upper = 0;
+	};
+	List<GroupResult> Groups;
+	int Games = 0;
+	int Draws = 0;
+	bool Converged = false; // 在用完 MaxGames 之前满足了停止条件
+	double Seconds = 0;
+	void Print(ostream& out)const
+	{
+		out << "Games: " << Games << (Converged ? "  Converged" : "  Not converged")
+			<< "  Time: " << Seconds << "s\n";
+		for (auto& group : Groups)
+			out << "GroupName: " << group.Name << "  WinRate: "
+				<< 100 * group.Probability << "% [" << 100 * group.Lower << "%, "
+				<< 100 * group.Upper << "%]\n";
+		out << "Draws: " << Draws << '\n';
+	}
+};
+
+// 自适应的胜率估计: 分批运行对局, 每批之后检查各组胜率的 Wilson 置信区间,
+// 足够窄时提前停止. 第 n 局的种子与 Simulator 相同, 因此前 n 局的胜负与
+// Simulator 运行 n 局一致. 每个线程只构造一次 Game, 之后每局 Reset 重赛,
+// 不再重新加入实体.
+class WinEstimator
+{
+public:
+	struct Options
+	{
+		double Tolerance = 0.01; // 各组置信区间的半宽都不超过它时停止
+		double Confidence = 0.95;
+		int MinGames = 256; // 第一批的局数, 之后每批与已运行的局数相同
+		int MaxGames = 100000;
+		int Threads = 0;
+		// 非空时做序贯判定: 该组胜率的置信区间不再包含 Threshold 时也停止
+		string Group;
+		double Threshold = 0.5;
+	};
+	explicit WinEstimator(const Roster& roster, size_t seed = 0) :
+		WinEstimator(roster, BuildAttributes(roster), seed)
+	{
+	}
+	WinEstimator(const Roster& roster,
+		List<Container<GamerenaAttribute>> attributes, size_t seed = 0) :
+		Attributes(move(attributes)), Seed(seed)
+	{
+		if (Attributes.size() != roster.size())
+			throw InvalidArgumentException("attributes don't match roster.");
+		for (auto& entry : roster)
+		{
+			Symbol key = SymbolTable::Global().Intern(entry.first);
+			if (GroupIndices.size() <= key)
+				GroupIndices.resize(key + 1, -1);
+			if (GroupIndices[key] < 0)
+			{
+				GroupIndices[key] = GroupNames.size();
+				GroupNames.push_back(entry.first);
+			}
+		}
+	}
+	WinEstimate Estimate(const Options& options)
+	{
+		if (options.Tolerance <= 0 || options.Confidence <= 0
+			|| options.Confidence >= 1 || options.MinGames <= 0
+			|| options.MaxGames < options.MinGames)
+			throw InvalidArgumentException("invalid estimate options.");
+		int decision = -1;
+		if (options.Group != "")
+		{
+			auto found = find(GroupNames.begin(), GroupNames.end(), options.Group);
+			if (found == GroupNames.end())
+				throw InvalidArgumentException("group isn't in the roster.");
+			decision = found - GroupNames.begin();
+		}
+		auto begin = chrono::steady_clock::now();
+		// 每批之后都检查一次, 多次检查会放大犯错的概率; 按计划的检查次数
+		// 平分允许的错误率(Bonferroni)
+		int looks = 1;
+		for (int n = options.MinGames; n < options.MaxGames; n = min(n * 2, options.MaxGames))
+			++looks;
+		double z = NormalQuantile(1 - (1 - options.Confidence) / (2 * looks));
+		int threads = options.Threads;
+		if (threads <= 0)
+			threads = max(1u, thread::hardware_concurrency());
+		threads = max(1, min(threads, options.MaxGames));
+		while (Games.size() < (size_t)threads)
+			AddGame();
+		List<int> wins(GroupNames.size());
+		WinEstimate result;
+		result.Groups.resize(GroupNames.size());
+		for (int batch = options.MinGames; result.Games < options.MaxGames;
+			batch = result.Games)
+		{
+			int end = result.Games + min(batch, options.MaxGames - result.Games);
+			List<List<int>> counts(threads, List<int>(GroupNames.size() + 1));
+			atomic<int> next(result.Games);
+			List<thread> workers;
+			auto work = [&](int i)
+			{
+				for (int n; (n = next++) < end;)
+					++counts[i][RunOne(i, n)];
+			};
+			for (int i = 1; i < threads; ++i)
+				workers.emplace_back(work, i);
+			work(0);
+			for (auto& worker : workers)
+				worker.join();
+			for (auto& count : counts)
+			{
+				for (size_t g = 0; g < wins.size(); ++g)
+					wins[g] += count[g];
+				result.Draws += count.back();
+			}
+			result.Games = end;
+			bool tight = true;
+			for (size_t g = 0; g < wins.size(); ++g)
+			{
+				auto& group = result.Groups[g];
+				group.Name = GroupNames[g];
+				group.Wins = wins[g];
+				group.Probability = (double)wins[g] / end;
+				Wilson(wins[g], end, z, group.Lower, group.Upper);
+				tight = tight && (group.Upper - group.Lower) / 2 <= options.Tolerance;
+			}
+			if (decision >= 0)
+			{
+				auto& group = result.Groups[decision];
+				tight = tight || group.Lower > options.Threshold
+					|| group.Upper < options.Threshold;
+			}
+			if (tight)
+			{
+				result.Converged = true;
+				break;
+			}
+		}
+		result.Seconds = chrono::duration<double>(
+			chrono::steady_clock::now() - begin).count();
+		return result;
+	}
+	// 标准正态分布的 p 分位数
+	static double NormalQuantile(double p)
+	{
+		double lo = -40, hi = 40;
+		for (int i = 0; i < 100; ++i)
+		{
+			double mid = (lo + hi) / 2;
+			(0.5 * erfc(-mid / sqrt(2.0)) < p ? lo : hi) = mid;
+		}
+		return (lo + hi) / 2;
+	}
+	// n 次中成功 k 次时的 Wilson 得分区间
+	static void Wilson(int k, int n, double z, double& lower, double& upper)
+	{
+		double p = (double)k / n, z2 = z * z;
+		double center = (p + z2 / (2 * n)) / (1 + z2 / n);
+		double half = z / (1 + z2 / n) * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n));
+		lower = max(0.0, center - half);
+		upper = min(1.0, center + half);
+	}
+private:
+	void AddGame()
+	{
+		Container<Game> game(new Game());
+		for (auto& attr : Attributes)
+			game->AddAttribute(attr);
+		Games.push_back(game);
+	}
+	// 在第 i 个 Game 上运行第 n 局, 返回获胜组的下标, 平局时返回组数
+	int RunOne(int i, int n)
+	{
+		const size_t SeedF = 2654435761u;
+		Game& game = *Games[i];
+		game.Reset(Seed + n * SeedF);
+		game.Start();
+		Symbol winner;
+		if (game.GetWinner(winner))
+			return GroupIndices[winner];
+		return GroupNames.size();
+	}
+	List<Container<GamerenaAttribute>> Attributes;
+	size_t Seed;
+	List<int> GroupIndices; // 以组名的 Symbol 为下标
+	List<string> GroupNames;
+	List<Container<Game>> Games; // 每个线程一个, 在多次 Estimate 之间复用
+};
+
+#ifndef _WIN32
+// 在作用域内忽略信号, 离开作用域(包括因异常离开)时恢复原来的处理方式
+class SignalIgnoreScope
+{
+public:
+	explicit SignalIgnoreScope(int signal) : Signal(signal)
+	{
+		struct sigaction action = {};
+		action.sa_handler = SIG_IGN;
+		sigemptyset(&action.sa_mask);
+		sigaction(Signal, &action, &Previous);
+	}
+	SignalIgnoreScope(const SignalIgnoreScope&) = delete;
+	SignalIgnoreScope& operator=(const SignalIgnoreScope&) = delete;
+	~SignalIgnoreScope()
+	{
+		sigaction(Signal, &Previous, nullptr);
+	}
+private:
+	int Signal;
+	struct sigaction Previous;
+};
+
+// 多进程锦标赛: 协调进程把多份名单的对局切成小批, 经管道分发给 fork 出的
+// 工作进程, 工作进程把每批的 SimulationReport 写回. 每个工作进程同时最多
+// 有两批未完成, 做完一批才领取下一批, 先做完的进程自然多做; 工作进程
+// 异常退出时, 它未完成的批次交给其他进程. 各批结果合并后与单进程运行
+// 完全相同.
+class Tournament
 {
-	ShowObject(*p, 0, 0);
-	cout << "  发起了攻击,";
-	CausePhysicDamage(p, t);
-}
+	struct Job
+	{
+		uint32_t Roster;
+		int32_t First;
+		int32_t Count; // 0 表示退出
+	};
+	struct Worker
+	{
+		pid_t Pid = -1;
+		int JobFd = -1;
+		int ResultFd = -1;
+		deque<Job> Pending; // 已发出, 尚未收到结果
+	};
+public:
+	void AddRoster(const string& name, const Roster& roster,
+		List<Container<GamerenaAttribute>> attributes)
+	{
+		Names.push_back(name);
+		Simulators.emplace_back(new Simulator(roster, move(attributes), Seed));
+	}
+	// 必须在 AddRoster 之前调用
+	void SetSeed(size_t seed)
+	{
+		Seed = seed;
+	}
+	// 每份名单各运行 games 局
+	List<SimulationReport> Run(int games, int workers)
+	{
+		auto begin = chrono::steady_clock::now();
+		workers = max(workers, 1);
+		Reports.clear();
+		Queue.clear();
+		for (size_t r = 0; r < Simulators.size(); ++r)
+		{
+			Reports.push_back(Simulators[r]->EmptyReport());
+			Reports.back().Threads = workers;
+			// 每个进程约分到 8 批, 批次足够小才能均衡
+			int batch = max(1, games / (workers * 8));
+			for (int first = 0; first < games; first += batch)
+				Queue.push_back({ (uint32_t)r, first, min(batch, games - first) });
+		}
+		// 写入已退出的工作进程的管道时返回 EPIPE 而不是终止协调进程
+		SignalIgnoreScope ignorePipe(SIGPIPE);
+		Workers.assign(workers, Worker());
+		for (auto& worker : Workers)
+			Spawn(worker);
+		for (auto& worker : Workers)
+			for (int i = 0; i < 2; ++i)
+				Assign(worker);
+		while (Busy())
+			Poll();
+		for (auto& worker : Workers)
+			Stop(worker);
+		double seconds = chrono::duration<double>(
+			chrono::steady_clock::now() - begin).count();
+		for (auto& report : Reports)
+			report.Seconds = seconds;
+		return Reports;
+	}
+	const string& GetName(size_t roster)const
+	{
+		return Names[roster];
+	}
+private:
+	void Spawn(Worker& worker)
+	{
+		int jobPipe[2], resultPipe[2];
+		if (pipe(jobPipe) != 0)
+			throw UnexceptedCallException("can't create pipes.");
+		if (pipe(resultPipe) != 0)
+		{
+			close(jobPipe[0]);
+			close(jobPipe[1]);
+			throw UnexceptedCallException("can't create pipes.");
+		}
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			for (int fd : { jobPipe[0], jobPipe[1], resultPipe[0], resultPipe[1] })
+				close(fd);
+			throw UnexceptedCallException("can't fork a worker.");
+		}
+		if (pid == 0)
+		{
+			close(jobPipe[1]);
+			close(resultPipe[0]);
+			// 关闭继承来的其他工作进程的管道, 否则它们收不到 EOF
+			for (auto& other : Workers)
+			{
+				if (other.JobFd >= 0) close(other.JobFd);
+				if (other.ResultFd >= 0) close(other.ResultFd);
+			}
+			// 异常不能离开子进程: 否则会展开到父进程复制来的调用栈中, 继续
+			// 执行协调者的代码. 协调者从管道读到 EOF 即知道工作进程失败
+			int status = 1;
+			try
+			{
+				status = Work(jobPipe[0], resultPipe[1]);
+			}
+			catch (...)
+			{
+			}
+			_exit(status);
+		}
+		close(jobPipe[0]);
+		close(resultPipe[1]);
+		worker.Pid = pid;
+		worker.JobFd = jobPipe[1];
+		worker.ResultFd = resultPipe[0];
+	}
+	int Work(int jobFd, int resultFd)
+	{
+		List<char> data;
+		Job job;
+		while (ReadAll(jobFd, &job, sizeof(job)) && job.Count > 0)
+		{
+			SimulationReport report =
+				Simulators[job.Roster]->RunRange(job.First, job.Count);
+			data.clear();
+			SnapshotWriter writer(data);
+			writer.Put(job);
+			report.Save(writer);
+			uint64_t size = data.size();
+			if (!WriteAll(resultFd, &size, sizeof(size))
+				|| !WriteAll(resultFd, data.data(), data.size()))
+				return 1;
+		}
+		return 0;
+	}
+	// 把队列中的下一批发给 worker
+	void Assign(Worker& worker)
+	{
+		if (Queue.empty() || worker.Pid < 0) return;
+		Job job = Queue.front();
+		if (!WriteAll(worker.JobFd, &job, sizeof(job)))
+		{
+			Fail(worker);
+			return;
+		}
+		Queue.pop_front();
+		worker.Pending.push_back(job);
+	}
+	bool Busy()const
+	{
+		if (!Queue.empty()) return true;
+		for (auto& worker : Workers)
+			if (!worker.Pending.empty()) return true;
+		return false;
+	}
+	void Poll()
+	{
+		List<pollfd> fds;
+		List<Worker*> owners;
+		for (auto& worker : Workers)
+			if (worker.Pid >= 0)
+			{
+				fds.push_back({ worker.ResultFd, POLLIN, 0 });
+				owners.push_back(&worker);
+			}
+		if (fds.empty())
+			throw UnexceptedCallException("all tournament workers have failed.");
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR) return;
+			throw UnexceptedCallException("poll failed.");
+		}
+		for (size_t i = 0; i < fds.size(); ++i)
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				Receive(*owners[i]);
+	}
+	void Receive(Worker& worker)
+	{
+		uint64_t size;
+		if (!ReadAll(worker.ResultFd, &size, sizeof(size)))
+		{
+			Fail(worker);
+			return;
+		}
+		Buffer.resize(size);
+		if (!ReadAll(worker.ResultFd, Buffer.data(), size))
+		{
+			Fail(worker);
+			return;
+		}
+		SnapshotReader reader(Buffer);
+		Job job;
+		reader.Get(job);
+		if (worker.Pending.empty() || memcmp(&job, &worker.Pending.front(), sizeof(job)) != 0)
+			throw UnexceptedCallException("tournament worker returned an unexpected batch.");
+		worker.Pending.pop_front();
+		SimulationReport report = Simulators[job.Roster]->EmptyReport();
+		report.Load(reader);
+		Reports[job.Roster].Merge(report);
+		Assign(worker);
+	}
+	// 工作进程已退出: 未完成的批次放回队列, 交给其他进程
+	void Fail(Worker& worker)
+	{
+		if (worker.Pid < 0) return;
+		Queue.insert(Queue.begin(), worker.Pending.begin(), worker.Pending.end());
+		worker.Pending.clear();
+		Stop(worker);
+		for (auto& other : Workers)
+			while (other.Pid >= 0 && other.Pending.size() < 2 && !Queue.empty())
+				Assign(other);
+	}
+	void Stop(Worker& worker)
+	{
+		if (worker.Pid < 0) return;
+		Job stop = { 0, 0, 0 };
+		WriteAll(worker.JobFd, &stop, sizeof(stop));
+		close(worker.JobFd);
+		close(worker.ResultFd);
+		waitpid(worker.Pid, nullptr, 0);
+		worker.Pid = -1;
+		worker.JobFd = worker.ResultFd = -1;
+	}
+	static bool ReadAll(int fd, void* data, size_t size)
+	{
+		for (char* p = (char*)data; size > 0;)
+		{
+			ssize_t n = read(fd, p, size);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+	static bool WriteAll(int fd, const void* data, size_t size)
+	{
+		for (const char* p = (const char*)data; size > 0;)
+		{
+			ssize_t n = write(fd, p, size);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+	size_t Seed = 0;
+	List<string> Names;
+	List<Container<Simulator>> Simulators;
+	List<SimulationReport> Reports;
+	List<Worker> Workers;
+	deque<Job> Queue;
+	List<char> Buffer;
+};
+#endif
 
-void BaseMagic(Entity * p, Entity * t)
+// 解析 "Name@GroupName"; 失败时返回错误信息, 成功时返回空串
+string ParseFullName(const string& fullName, string& name, string& groupName)
 {
-	ShowObject(*p, 0, 0);
-	cout << "  使用法术攻击,";
-	CauseMagicDamage(p, t);
+	size_t nameLength = fullName.find_last_of('@');
+	name = string(fullName, 0, nameLength);
+	if (name == "")
+		return "Name shouldn\'t be empty.\n";
+	if (nameLength != string::npos)
+		groupName = string(fullName, nameLength + 1, string::npos);
+	else
+		groupName = "~@Default";
+	if (groupName == "")
+		return "GroupName shouldn\'t be empty.\n";
+	return "";
 }
 
-void FireBall(Entity* p, Entity* t)
+// 并发去重的名字集合. 每个名字记录最早出现的位置, 位置小者胜出,
+// 因此并行导入与逐行导入得到同样的结果. 按哈希分片加锁以减少争用.
+class ConcurrentNameSet
 {
-	ShowObject(*p, 0, 0);
-	cout << "  发射出火球,";
-	CauseMagicDamage(p, t, 1.8);
-}
+public:
+	// 以 position 登记 name; 若当前没有更早的登记者则返回 true
+	bool Claim(const string& name, uint64_t position)
+	{
+		auto& shard = GetShard(name);
+		lock_guard<mutex> lock(shard.Lock);
+		auto result = shard.Owners.emplace(name, position);
+		if (result.second)
+			return true;
+		if (position < result.first->second)
+			result.first->second = position;
+		return result.first->second == position;
+	}
+	// 返回最早登记 name 的位置, 未登记时返回 NoOwner
+	uint64_t GetOwner(const string& name)
+	{
+		auto& shard = GetShard(name);
+		lock_guard<mutex> lock(shard.Lock);
+		auto it = shard.Owners.find(name);
+		return it == shard.Owners.end() ? uint64_t(NoOwner) : it->second;
+	}
+	enum : uint64_t { NoOwner = UINT64_MAX };
+private:
+	enum { ShardCount = 64 };
+	struct alignas(64) Shard
+	{
+		mutex Lock;
+		HashMap<string, uint64_t> Owners;
+	};
+	Shard& GetShard(const string& name)
+	{
+		return Shards[hash<string>()(name) % ShardCount];
+	}
+	Shard Shards[ShardCount];
+};
 
-void Critical(Entity* p, Entity* t)
+struct RosterFile
 {
-	ShowObject(*p, 0, 0);
-	cout << "  瞄准了目标的弱点攻击,";
-	CausePhysicDamage(p, t, 2.15);
-}
+	Roster Entries;
+	// 与 Entries 一一对应, 可直接交给 Game::AddAttribute
+	List<Container<GamerenaAttribute>> Attributes;
+	size_t Duplicates = 0;
+	size_t Invalid = 0;
+};
 
-void Cuel(Entity* p, Entity* t)
+// 映射名单文件并按行("Name@GroupName")分块并行解析. position 是文件开头
+// 在整个输入中的位置, 返回时前移到文件之后; 与 names 中已有的名字重复,
+// 或在文件中较晚出现的重名都会被跳过.
+RosterFile LoadRoster(const string& path, ConcurrentNameSet& names,
+	uint64_t& position, int threads = 0)
 {
-	ShowObject(*p, 0, 0);
-	cout << "  使用了治愈魔法,";
-	MakeCuel(p, t, 1.2);
+	MappedFile file(path);
+	const char* data = file.GetData();
+	size_t size = file.GetSize();
+	uint64_t base = position;
+	position += size + 1;
+	if (threads <= 0)
+		threads = max(1u, thread::hardware_concurrency());
+	const size_t MinChunk = 1 << 16;
+	threads = max(1, min<int>(threads, size / MinChunk));
+	// 块边界对齐到行首
+	List<size_t> bounds(1, 0);
+	for (int i = 1; i < threads; ++i)
+	{
+		size_t bound = max(bounds.back(), size * i / threads);
+		while (bound < size && bound > 0 && data[bound - 1] != '\n')
+			++bound;
+		bounds.push_back(bound);
+	}
+	bounds.push_back(size);
+	struct Line
+	{
+		uint64_t Position;
+		string GroupName, Name;
+	};
+	struct Chunk
+	{
+		List<Line> Lines;
+		RosterFile Result;
+	};
+	List<Chunk> chunks(threads);
+	auto parallel = [threads](const Delegate<void(int)>& body)
+	{
+		List<thread> workers;
+		for (int i = 1; i < threads; ++i)
+			workers.emplace_back(body, i);
+		body(0);
+		for (auto& worker : workers)
+			worker.join();
+	};
+	parallel([&](int i)
+		{
+			auto& chunk = chunks[i];
+			string fullName, name, groupName;
+			for (size_t begin = bounds[i], end; begin < bounds[i + 1]; begin = end + 1)
+			{
+				end = begin;
+				while (end < bounds[i + 1] && data[end] != '\n')
+					++end;
+				size_t length = end - begin;
+				if (length > 0 && data[end - 1] == '\r')
+					--length;
+				if (length == 0 || data[begin] == '>')
+					continue;
+				fullName.assign(data + begin, length);
+				if (ParseFullName(fullName, name, groupName) != "")
+				{
+					++chunk.Result.Invalid;
+					continue;
+				}
+				names.Claim(name, base + begin);
+				chunk.Lines.push_back({ base + begin, groupName, name });
+			}
+		});
+	// 所有块登记完毕后, 只保留最早出现的名字
+	parallel([&](int i)
+		{
+			auto& chunk = chunks[i];
+			for (auto& line : chunk.Lines)
+			{
+				if (names.GetOwner(line.Name) != line.Position)
+				{
+					++chunk.Result.Duplicates;
+					continue;
+				}
+				chunk.Result.Entries.emplace_back(move(line.GroupName), move(line.Name));
+			}
+			chunk.Lines = List<Line>();
+			chunk.Result.Attributes = BuildAttributes(chunk.Result.Entries, 1);
+		});
+	RosterFile result;
+	for (auto& chunk : chunks)
+	{
+		auto& part = chunk.Result;
+		move(part.Entries.begin(), part.Entries.end(), back_inserter(result.Entries));
+		move(part.Attributes.begin(), part.Attributes.end(), back_inserter(result.Attributes));
+		result.Duplicates += part.Duplicates;
+		result.Invalid += part.Invalid;
+	}
+	return result;
 }
 
+void PrintStats(ostream& out, const Game* game);
 
-void SkillSelector::GenerateSkill(GamerenaAttribute* pAttr)
+// MyGamerena --simulate <games> [--threads <n>] [--seed <n>] [--roster <file>]
+//     [--stats 1] < roster
+// 指定 --roster 时从文件导入名单, 不再读取标准输入
+int Simulate(int argc, char* argv[])
 {
-	GamerenaAttribute& attr = *pAttr;
-	int BaseAttackPriority =
-		250 + (attr.BaseAttack - attr.BaseMagic) * 4 * (0.5 + Random());
-	int BaseMagicPriority =
-		250 + (attr.BaseMagic - attr.BaseAttack) * 4 * (0.5 + Random());
-	int FireBallPriority =
-		50 + (attr.BaseIntelligence >> 1) + (attr.BaseMagic);
-	int CriticalPriority =
-		30 + (attr.BaseIntelligence >> 2) + (attr.BaseAttack >> 1)
-		+ (attr.BaseAccuracy >> 1);
-	int CuelPriority =
-		60 + (attr.BaseIntelligence >> 1) + (attr.BaseMagic >> 2);
-	AddSkill({ BaseAttack, Targets.Enemy, BaseAttackPriority });
-	AddSkill({ BaseMagic, Targets.Enemy, BaseMagicPriority });
-	if (FireBallPriority > 140)
-		AddSkill({ FireBall, Targets.Enemy, FireBallPriority });
-	if (CriticalPriority > 125)
-		AddSkill({ Critical, Targets.Enemy, CriticalPriority });
-	if (CuelPriority > 100)
-		AddSkill({ Cuel, Targets.Teammate, CuelPriority });
+	int games = atoi(argv[2]);
+	int threads = 0;
+	size_t seed = time(0);
+	string rosterPath;
+	bool stats = false;
+	for (int i = 3; i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		if (option == "--threads")
+			threads = atoi(argv[i + 1]);
+		else if (option == "--seed")
+			seed = strtoull(argv[i + 1], nullptr, 10);
+		else if (option == "--roster")
+			rosterPath = argv[i + 1];
+		else if (option == "--stats")
+			stats = atoi(argv[i + 1]) != 0;
+	}
+	if (rosterPath != "")
+	{
+		ConcurrentNameSet names;
+		uint64_t position = 0;
+		RosterFile file = LoadRoster(rosterPath, names, position, threads);
+		cout << "Seed: " << seed << '\n';
+		Simulator(file.Entries, move(file.Attributes), seed).Run(games, threads).Print(cout);
+		if (stats) PrintStats(cout, nullptr);
+		return 0;
+	}
+	Roster roster;
+	unordered_set<string> nameUsed;
+	string fullName, name, groupName;
+	while (getline(cin, fullName))
+	{
+		if (fullName.empty() || fullName[0] == '>')
+			continue;
+		string error = ParseFullName(fullName, name, groupName);
+		if (error != "")
+		{
+			cout << error;
+			continue;
+		}
+		if (nameUsed.insert(name).second)
+			roster.emplace_back(groupName, name);
+	}
+	cout << "Seed: " << seed << '\n';
+	Simulator(roster, seed).Run(games, threads).Print(cout);
+	if (stats) PrintStats(cout, nullptr);
+	return 0;
 }
 
-inline void GamerenaModifier::ModifyState(IState* state)const
+#ifndef _WIN32
+// MyGamerena --tournament <games> [--workers <n>] [--seed <n>] <roster>...
+// 每份名单各运行 games 局, 分摊到 n 个工作进程; 未给出名单时从标准输入读取
+int RunTournament(int argc, char* argv[])
 {
-	GamerenaState* pState = dynamic_cast<GamerenaState*>(state);
-	if (pState == nullptr)
-		throw InvalidArgumentException(
-			"state can\'t be null and have type of \"EntityState\".");
-	GamerenaState& State = *pState;
-	State.HP = max(State.HP + HPModifier, 0);
+	int games = atoi(argv[2]);
+	int workers = max(1u, thread::hardware_concurrency());
+	size_t seed = time(0);
+	List<string> paths;
+	for (int i = 3; i < argc; ++i)
+	{
+		string option = argv[i];
+		if (option == "--workers" && i + 1 < argc)
+			workers = atoi(argv[++i]);
+		else if (option == "--seed" && i + 1 < argc)
+			seed = strtoull(argv[++i], nullptr, 10);
+		else
+			paths.push_back(option);
+	}
+	Tournament tournament;
+	tournament.SetSeed(seed);
+	for (auto& path : paths)
+	{
+		ConcurrentNameSet names;
+		uint64_t position = 0;
+		RosterFile file = LoadRoster(path, names, position);
+		tournament.AddRoster(path, file.Entries, move(file.Attributes));
+	}
+	if (paths.empty())
+	{
+		Roster roster;
+		unordered_set<string> nameUsed;
+		string fullName, name, groupName;
+		while (getline(cin, fullName))
+		{
+			if (fullName.empty() || fullName[0] == '>') continue;
+			if (ParseFullName(fullName, name, groupName) == ""
+				&& nameUsed.insert(name).second)
+				roster.emplace_back(groupName, name);
+		}
+		tournament.AddRoster("<stdin>", roster, BuildAttributes(roster));
+	}
+	cout << "Seed: " << seed << '\n';
+	auto reports = tournament.Run(games, workers);
+	for (size_t i = 0; i < reports.size(); ++i)
+	{
+		cout << "Roster: " << tournament.GetName(i) << '\n';
+		reports[i].Print(cout);
+	}
+	return 0;
 }
+#endif
 
-inline void GamerenaModifier::Modify(IAttribute* attribute)const
+// MyGamerena --estimate [--tolerance <x>] [--confidence <x>] [--min-games <n>]
+//     [--max-games <n>] [--threads <n>] [--seed <n>] [--group <name>]
+//     [--threshold <x>] [--roster <file>] < roster
+// 估计各组的胜率, 置信区间足够窄(或已能判定 group 的胜率高于或低于
+// threshold)时停止
+int Estimate(int argc, char* argv[])
 {
-	GamerenaAttribute* pAttribute =
-		dynamic_cast<GamerenaAttribute*>(attribute);
-	if (pAttribute == nullptr)
-		throw InvalidArgumentException(
-			"attribute can\'t be null and have type of \"EntityAttribute\".");
-	GamerenaAttribute& Attribute = *pAttribute;
-	Attribute.BaseHP =
-		max(Attribute.BaseHP + HPModifier, 1);
-	Attribute.BaseAttack =
-		max(Attribute.BaseAttack + AttackModifier, 0);
-	Attribute.BaseDefense =
-		Attribute.BaseDefense + DefenseModifier;
-	Attribute.BaseMagic =
-		max(Attribute.BaseMagic + MagicModifier, 0);
-	Attribute.BaseMagicDefense =
-		Attribute.BaseMagicDefense + MagicDefenseModifier;
-	Attribute.BaseSpeed =
-		Attribute.BaseSpeed + SpeedModifier;
-	Attribute.BaseAccuracy =
-		max(Attribute.BaseSpeed + AccuracyModifier, 5);
-	Attribute.BaseIntelligence =
-		max(Attribute.BaseIntelligence + IntelligenceModifier, 0);
+	WinEstimator::Options options;
+	size_t seed = time(0);
+	string rosterPath;
+	for (int i = 2; i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		if (option == "--tolerance")
+			options.Tolerance = atof(argv[i + 1]);
+		else if (option == "--confidence")
+			options.Confidence = atof(argv[i + 1]);
+		else if (option == "--min-games")
+			options.MinGames = atoi(argv[i + 1]);
+		else if (option == "--max-games")
+			options.MaxGames = atoi(argv[i + 1]);
+		else if (option == "--threads")
+			options.Threads = atoi(argv[i + 1]);
+		else if (option == "--seed")
+			seed = strtoull(argv[i + 1], nullptr, 10);
+		else if (option == "--group")
+			options.Group = argv[i + 1];
+		else if (option == "--threshold")
+			options.Threshold = atof(argv[i + 1]);
+		else if (option == "--roster")
+			rosterPath = argv[i + 1];
+	}
+	Roster roster;
+	List<Container<GamerenaAttribute>> attributes;
+	if (rosterPath != "")
+	{
+		ConcurrentNameSet names;
+		uint64_t position = 0;
+		RosterFile file = LoadRoster(rosterPath, names, position, options.Threads);
+		roster = move(file.Entries);
+		attributes = move(file.Attributes);
+	}
+	else
+	{
+		unordered_set<string> nameUsed;
+		string fullName, name, groupName;
+		while (getline(cin, fullName))
+		{
+			if (fullName.empty() || fullName[0] == '>') continue;
+			if (ParseFullName(fullName, name, groupName) == ""
+				&& nameUsed.insert(name).second)
+				roster.emplace_back(groupName, name);
+		}
+		attributes = BuildAttributes(roster, options.Threads);
+	}
+	cout << "Seed: " << seed << '\n';
+	WinEstimator(roster, move(attributes), seed).Estimate(options).Print(cout);
+	return 0;
 }
 
-inline void ResetState(GamerenaState& state, const GamerenaAttribute& attr)
+void ShowGroups(const Game& game, int level)
 {
-	state.GroupIndex = attr.OriginGroupIndex;
-	state.HP = attr.BaseHP;
-	state.Attack = attr.BaseAttack;
-	state.Defense = attr.BaseDefense;
-	state.Magic = attr.BaseMagic;
-	state.MagicDefense = attr.BaseMagicDefense;
-	state.Speed = attr.BaseSpeed;
-	state.Accuracy = attr.BaseAccuracy;
-	state.Intelligence = attr.BaseIntelligence;
+	for (auto& pair : game.GetGroups())
+	{
+		cout << "GroupName: " << SymbolTable::Global().GetName(pair.first) << '\n';
+		for (auto& member : pair.second)
+		{
+			ShowObject(*member, 4, level);
+			cout.put('\n');
+		}
+	}
 }
 
-inline GamerenaState* GamerenaAttribute::CreateDefaultState()const
+// 输出性能计数(所有线程累计), 本线程的分配次数, 以及 game 的内存与存活情况
+void PrintStats(ostream& out, const Game* game)
 {
-	auto state = new GamerenaState();
-	ResetState(*state, *this);
-	return state;
+	out << "Stats:\n";
+	for (int i = 0; i < (int)PerfMetric::Count; ++i)
+	{
+		PerfMetric metric = (PerfMetric)i;
+		PerfCounters::Metric m = PerfCounters::Collect(metric);
+		out << "    " << PerfCounters::GetName(metric) << ": " << m.Count;
+		if (m.Samples == 0)
+		{
+			out << '\n';
+			continue;
+		}
+		// 分位数取所在桶的上界
+		uint64_t percentiles[] = { 50, 99 };
+		uint64_t bounds[2] = {};
+		for (int p = 0; p < 2; ++p)
+		{
+			uint64_t seen = 0;
+			int bucket = 0;
+			for (; bucket < PerfCounters::Buckets; ++bucket)
+			{
+				seen += m.Histogram[bucket];
+				if (seen * 100 >= m.Samples * percentiles[p]) break;
+			}
+			bounds[p] = uint64_t(2) << bucket;
+		}
+		out << "  avg: " << m.TotalNs / m.Samples << "ns"
+			<< "  p50: <" << bounds[0] << "ns"
+			<< "  p99: <" << bounds[1] << "ns"
+			<< "  max: " << m.MaxNs << "ns\n";
+	}
+	// 内存池的计数按线程分开且不登记, 这里只有调用线程(即主线程)的分配,
+	// 不含其他线程(如同刻结算与批量模拟的工作线程)
+	const AllocationCounters& allocations = GetAllocationCounters();
+	out << "    allocations (calling thread only): " << allocations.Allocations
+		<< "  deallocations: " << allocations.Deallocations << '\n';
+	if (game == nullptr) return;
+	const MemoryPool& pool = *game->GetMemoryPool();
+	out << "    pool_blocks: " << pool.GetLiveCount()
+		<< "  pool_bytes: " << pool.GetChunkBytes() << '\n'
+		<< "    alive: " << game->GetAliveCount()
+		<< '/' << game->GetEntities().size() << '\n';
 }
 
-void ShowObject(const Entity& e, int space, int level)
+// ">" 开头的命令. 一行为 ">命令 参数", 参数可以为空
+class CommandMode
 {
-	const GamerenaState& state = *GetGamerenaState(e);
-	auto modifiedAttr = e.GetModifiedAttribute();
-	GamerenaAttribute& attr = *(GamerenaAttribute*)modifiedAttr.get();
-	auto PrintSpace = [&](){
-		for (int i = 0; i < space; ++i) cout.put('\0');
-	};
-	PrintSpace();
-	cout << "Name: " << attr.GetName() << "  "
-		 << "HP: " << state.HP << " / " << attr.BaseHP << "  <";
-	int b = (state.HP + 10) / 20;
-	for (int i = 0; i < b; ++i) cout.put(2);
-	for (int i = b; i < (attr.BaseHP + 10) / 20; ++i) cout.put(1);
-	cout << ">\n";
-	if (level > 1)
-	{
-		PrintSpace();
-		cout << "Score: " << state.Score << '\n';
-	}
-	if (!state.Active)
+public:
+	// 参数无效时 handler 返回 false, 此时输出 usage
+	using Handler = Delegate<bool(const string&)>;
+	void Register(const string& name, const string& usage, const Handler& handler)
 	{
-		PrintSpace();
-		cout << "+-| xD\n";
-		return;
+		if (!handler)
+			throw InvalidArgumentException("handler is null/invalid.");
+		Commands[name] = { usage, handler };
 	}
-	if (level > 0)
+	// line 不含开头的 '>'
+	bool Execute(const string& line, ostream& out)
 	{
-		PrintSpace();
-		cout << "Atk: " << attr.BaseAttack << "\tDef: " << attr.BaseDefense
-			 << "\t\tAcc: " << attr.BaseAccuracy << '\n';
-		PrintSpace();
-		cout << "Mag: " << attr.BaseMagic << "\tMagDef: " << attr.BaseMagicDefense
-			 << "\tSpd: " << attr.BaseSpeed << "\tInt: " << attr.BaseIntelligence
-			 << '\n';
+		size_t space = line.find(' ');
+		string name = line.substr(0, space);
+		string args = space == string::npos ? "" : line.substr(space + 1);
+		auto it = Commands.find(name);
+		if (it == Commands.end())
+		{
+			out << "Unknown command \"" << name << "\".\n";
+			return false;
+		}
+		if (it->second.second(args))
+			return true;
+		out << "Usage: >" << name << ' ' << it->second.first << '\n';
+		return false;
 	}
+private:
+	HashMap<string, pair<string, Handler>> Commands;
+};
+
+// 用法: --replay <录像文件> [--time <时刻>], 默认显示结束时的局面
+int Replay(int argc, char* argv[])
+{
+	ReplayReader reader(argv[2]);
+	int time = reader.GetEndTime();
+	if (argc >= 5 && string(argv[3]) == "--time")
+		time = atoi(argv[4]);
+	Game& game = reader.Seek(time);
+	cout << "Seed: " << reader.GetSeed() << '\n'
+		 << "Time: " << game.GetCurrentTime() << " / " << reader.GetEndTime()
+		 << '\n';
+	ShowGroups(game, 2);
+	return 0;
 }
 
-int main()
+#ifndef GAMERENA_NO_MAIN
+int main(int argc, char* argv[])
 {
 	ios::sync_with_stdio(false);
+	if (argc >= 3 && string(argv[1]) == "--simulate")
+		return Simulate(argc, argv);
+	if (argc >= 3 && string(argv[1]) == "--replay")
+		return Replay(argc, argv);
+	if (argc >= 2 && string(argv[1]) == "--estimate")
+		return Estimate(argc, argv);
+#ifndef _WIN32
+	if (argc >= 3 && string(argv[1]) == "--tournament")
+		return RunTournament(argc, argv);
+#endif
 	string fullName;
 	const string DefaultSeed = "${DefaultSeed}";
 	string seed = DefaultSeed;
-	Game game;
-	unordered_set<string> nameUsed;
+	string recordPath;
+	Roster roster;
+	// 与 roster 一一对应; 由 ">load" 导入的名字已生成属性, 其余为空
+	List<Container<GamerenaAttribute>> attributes;
+	ConcurrentNameSet nameUsed;
+	uint64_t position = 0;
+	bool statsAtEnd = false;
+	CommandMode commands;
+	commands.Register("seed", "<seed>", [&](const string& args)
+		{
+			if (args == "") return false;
+			seed = args;
+			cout << "Seed: " << seed << ".\n";
+			return true;
+		});
+	commands.Register("record", "<path>", [&](const string& args)
+		{
+			if (args == "") return false;
+			recordPath = args;
+			cout << "Record: " << recordPath << ".\n";
+			return true;
+		});
+	commands.Register("load", "<path>", [&](const string& args)
+		{
+			if (args == "") return false;
+			RosterFile file = LoadRoster(args, nameUsed, position);
+			cout << "Loaded " << file.Entries.size() << " names, skipped "
+				 << file.Duplicates << " used and " << file.Invalid << " invalid.\n";
+			move(file.Entries.begin(), file.Entries.end(), back_inserter(roster));
+			move(file.Attributes.begin(), file.Attributes.end(), back_inserter(attributes));
+			return true;
+		});
+	int tickThreads = 0;
+	commands.Register("parallel", "<threads>", [&](const string& args)
+		{
+			if (args == "" || args.find_first_not_of("0123456789") != string::npos)
+				return false;
+			tickThreads = atoi(args.c_str());
+			cout << "Parallel: " << tickThreads << ".\n";
+			return true;
+		});
+	// 立即输出一次, 对局结束时再输出一次
+	commands.Register("stats", "", [&](const string&)
+		{
+			PrintStats(cout, nullptr);
+			statsAtEnd = true;
+			return true;
+		});
 	while (getline(cin, fullName))
 	{
 		if (fullName[0] == '>')
 		{
-			// TODO: CommandMode
-			cout << "Command is working.\n";
+			commands.Execute(fullName.substr(1), cout);
 			continue;
 		}
-		size_t nameLength = fullName.find_last_of('@');
-		string name(fullName, 0, nameLength);
-		if (name == "")
+		string name, groupName;
+		string error = ParseFullName(fullName, name, groupName);
+		if (error != "")
 		{
-			cout << "Name shouldn\'t be empty.\n";
+			cout << error;
 			continue;
 		}
-		if (nameUsed.count(name) == 0)
+		if (nameUsed.Claim(name, position++))
 		{
-			nameUsed.insert(name);
-			string groupName;
-			if (nameLength != string::npos)
-				groupName = string(fullName, nameLength + 1, string::npos);
-			else
-				groupName = "~@Default";
-			if (groupName == "")
-			{
-				cout << "GroupName shouldn\'t be empty.\n";
-				continue;
-			}
 			cout << "Name: " << name << ", GroupName: " << groupName << ".\n";
-			game.AddName(groupName, name);
+			roster.emplace_back(groupName, name);
+			attributes.emplace_back(nullptr);
 		}
 		else
 		{
@@ -719,30 +4896,52 @@ int main()
 	}
 	const size_t srandF = 73;
 	const size_t srandS = 749431;
-	srand(/*hash<string>()(seed)*/time(0) * srandF + srandS);
-	for (auto& pair : game.GetGroups())
+	// 使用同一个种子(">seed <n>")可以完全重现一局
+	uint64_t seedValue;
+	if (seed == DefaultSeed)
+		seedValue = time(0) * srandF + srandS;
+	else if (seed.find_first_not_of("0123456789") == string::npos)
+		seedValue = strtoull(seed.c_str(), nullptr, 10);
+	else
+		seedValue = hash<string>()(seed);
+	cout << "Seed: " << seedValue << '\n';
+	Game game(seedValue);
+	game.SetTickThreads(tickThreads);
+	for (size_t i = 0; i < roster.size(); ++i)
 	{
-		cout << "GroupName: " << pair.first << '\n';
-		for (auto& member : pair.second)
-		{
-			ShowObject(*member, 4, 1);
-			cout.put('\n');
-		}
+		if (attributes[i])
+			game.AddAttribute(attributes[i]);
+		else
+			game.AddName(roster[i].first, roster[i].second);
+	}
+	ShowGroups(game, 1);
+	Container<ReplayWriter> replay = nullptr;
+	if (recordPath != "")
+	{
+		replay = Container<ReplayWriter>(
+			new ReplayWriter(recordPath, roster, seedValue, false, 4096, tickThreads > 0));
+		game.SetReplayWriter(replay.get());
 	}
 	cin.ignore(1024, '\n');
 	cout << "PressAnyKeyToStart...\n";
 	cin.get();
+	BattleTextRenderer renderer(game, cout);
+	EventLog log([&renderer](const BattleEvent& e) { renderer(e); });
+	game.SetEventLog(&log);
 	game.Start();
-	cin.ignore(1024, '\n');
-	for (auto& pair : game.GetGroups())
+	game.SetEventLog(nullptr);
+	log.Close();
+	if (replay)
 	{
-		cout << "GroupName: " << pair.first << '\n';
-		for (auto& member : pair.second)
-		{
-			ShowObject(*member, 4, 2);
-			cout.put('\n');
-		}
+		replay->Close();
+		if (replay->GetSkippedKeyframes())
+			cout << "Replay: " << replay->GetSkippedKeyframes()
+				<< " keyframes skipped (modifiers can't be recorded).\n";
 	}
+	cin.ignore(1024, '\n');
+	ShowGroups(game, 2);
+	if (statsAtEnd) PrintStats(cout, &game);
 	cout << "Done...\n";
 	cin.get();
 }
+#endif
@@ -9,6 +9,12 @@
 #include <algorithm>
 #include <functional>
 #include <exception>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
 
 namespace GameCore
 {
@@ -43,27 +49,315 @@ public:
 	string Message;
 };
 
+// Dense id of an interned name. Symbol 0 is the empty string.
+using Symbol = uint32_t;
+
+// Process-wide name interning. Every distinct name is given the next id
+// once; equal names always get the same id, so names can be compared,
+// stored and indexed as integers. Safe to use from several threads.
+// Names are stored in fixed-size blocks that never move and are published
+// through an atomic count, so GetName and Size never lock. Lookups hit a
+// per-thread cache first and lock only the first time a thread sees a
+// name; interning a whole batch locks once.
+class SymbolTable
+{
+public:
+	static SymbolTable& Global()
+	{
+		static SymbolTable table;
+		return table;
+	}
+	Symbol Intern(const string& name)
+	{
+		auto& cache = Cache();
+		auto iter = cache.find(name);
+		if (iter != cache.end())
+			return iter->second;
+		Symbol id;
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			id = InternLocked(name);
+		}
+		cache.emplace(name, id);
+		return id;
+	}
+	// Interns every name in one critical section; ids[i] is the symbol of
+	// *names[i]. Meant for bulk loads of mostly new names, which the
+	// per-thread cache would not help.
+	void Intern(const List<const string*>& names, List<Symbol>& ids)
+	{
+		ids.resize(names.size());
+		std::lock_guard<std::mutex> lock(Mutex);
+		for (size_t i = 0; i < names.size(); ++i)
+			ids[i] = InternLocked(*names[i]);
+	}
+	// Looks up a name without interning it.
+	bool TryFind(const string& name, Symbol& id)const
+	{
+		auto& cache = Cache();
+		auto iter = cache.find(name);
+		if (iter == cache.end())
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			auto found = Ids.find(name);
+			// Misses are not cached: another thread may intern the name later.
+			if (found == Ids.end())
+				return false;
+			iter = cache.emplace(name, found->second).first;
+		}
+		id = iter->second;
+		return true;
+	}
+	// The reference stays valid for the life of the program.
+	const string& GetName(Symbol id)const
+	{
+		if (id >= Count.load(std::memory_order_acquire))
+			throw std::out_of_range("symbol is out of range.");
+		return Blocks[id / BlockSize][id % BlockSize];
+	}
+	size_t Size()const
+	{
+		return Count.load(std::memory_order_acquire);
+	}
+private:
+	enum : Symbol { BlockSize = 1 << 12, MaxBlocks = 1 << 14 };
+	SymbolTable() { Intern(""); }
+	// There is only the global table, so one cache per thread suffices.
+	static HashMap<string, Symbol>& Cache()
+	{
+		thread_local HashMap<string, Symbol> cache;
+		return cache;
+	}
+	Symbol InternLocked(const string& name)
+	{
+		auto iter = Ids.find(name);
+		if (iter != Ids.end())
+			return iter->second;
+		Symbol id = Count.load(std::memory_order_relaxed);
+		if (id / BlockSize >= MaxBlocks)
+			throw InvalidArgumentException("too many names.");
+		auto& block = Blocks[id / BlockSize];
+		if (block == nullptr)
+			block.reset(new string[BlockSize]);
+		block[id % BlockSize] = name;
+		Ids.emplace(name, id);
+		// Publishes the name (and its block) to lock-free readers.
+		Count.store(id + 1, std::memory_order_release);
+		return id;
+	}
+	mutable std::mutex Mutex;
+	HashMap<string, Symbol> Ids;
+	std::unique_ptr<string[]> Blocks[MaxBlocks];
+	std::atomic<Symbol> Count{ 0 };
+};
+
 struct INamable
 {
 public:
 	INamable() = default;
 	virtual ~INamable() = default;
-	virtual bool HasName(const string& name) { return name == Name; }
-	const string& GetName()const { return Name; }
+	virtual bool HasName(const string& name)
+	{
+		Symbol id;
+		return SymbolTable::Global().TryFind(name, id) && id == NameId;
+	}
+	bool HasName(Symbol name)const { return name == NameId; }
+	const string& GetName()const
+	{
+		return SymbolTable::Global().GetName(NameId);
+	}
+	Symbol GetNameId()const { return NameId; }
 protected:
 	void SetName(const string& name)
 	{
-		Name = name;
+		NameId = SymbolTable::Global().Intern(name);
+	}
+	void SetName(Symbol name)
+	{
+		NameId = name;
+	}
+private:
+	Symbol NameId = 0;
+};
+
+// Size-class pool for game objects. Blocks are carved from large chunks
+// and recycled through per-class free lists; all chunks are returned in
+// one go when the pool is destroyed. A pool is used from one thread only.
+class MemoryPool
+{
+public:
+	MemoryPool() = default;
+	MemoryPool(const MemoryPool&) = delete;
+	MemoryPool& operator=(const MemoryPool&) = delete;
+	~MemoryPool()
+	{
+		for (auto chunk : Chunks)
+			::operator delete(chunk);
+	}
+	void* Allocate(size_t size)
+	{
+		++LiveCount;
+		if (size > MaxBlockSize)
+			return ::operator new(size);
+		size_t sizeClass = (size + Alignment - 1) / Alignment;
+		FreeBlock*& head = FreeLists[sizeClass];
+		if (head != nullptr)
+		{
+			FreeBlock* block = head;
+			head = block->Next;
+			return block;
+		}
+		size = sizeClass * Alignment;
+		if (ChunkUsed + size > ChunkSize || Chunks.empty())
+		{
+			Chunks.push_back(::operator new(ChunkSize));
+			ChunkUsed = 0;
+		}
+		void* block = (char*)Chunks.back() + ChunkUsed;
+		ChunkUsed += size;
+		return block;
+	}
+	void Deallocate(void* pointer, size_t size)
+	{
+		if (size > MaxBlockSize)
+			::operator delete(pointer);
+		else
+		{
+			FreeBlock*& head = FreeLists[(size + Alignment - 1) / Alignment];
+			head = new(pointer) FreeBlock{ head };
+		}
+		if (--LiveCount == 0 && Released)
+			delete this;
+	}
+	// Called by the owner instead of delete. Blocks that are still alive
+	// keep the pool until the last of them is freed.
+	void Release()
+	{
+		if (LiveCount == 0) delete this;
+		else Released = true;
+	}
+	size_t GetLiveCount()const { return LiveCount; }
+	size_t GetChunkCount()const { return Chunks.size(); }
+	size_t GetChunkBytes()const { return Chunks.size() * ChunkSize; }
+	// The pool new game objects are allocated from on this thread; nullptr
+	// means the global heap.
+	static MemoryPool*& Current()
+	{
+		thread_local MemoryPool* current = nullptr;
+		return current;
+	}
+	static const size_t Alignment = 16;
+private:
+	static const size_t MaxBlockSize = 512;
+	static const size_t ChunkSize = 64 * 1024;
+	struct FreeBlock { FreeBlock* Next; };
+	FreeBlock* FreeLists[MaxBlockSize / Alignment + 1] = {};
+	List<void*> Chunks;
+	size_t ChunkUsed = 0;
+	size_t LiveCount = 0;
+	bool Released = false;
+};
+
+// Makes pool the current pool of this thread until the scope ends.
+class MemoryPoolScope
+{
+public:
+	explicit MemoryPoolScope(MemoryPool* pool) : Previous(MemoryPool::Current())
+	{
+		MemoryPool::Current() = pool;
+	}
+	MemoryPoolScope(const MemoryPoolScope&) = delete;
+	MemoryPoolScope& operator=(const MemoryPoolScope&) = delete;
+	~MemoryPoolScope()
+	{
+		MemoryPool::Current() = Previous;
 	}
 private:
-	string Name;
+	MemoryPool* Previous;
+};
+
+// Allocations made through PoolAllocate on this thread, for profiling.
+struct AllocationCounters
+{
+	uint64_t Allocations = 0;
+	uint64_t Deallocations = 0;
+};
+inline AllocationCounters& GetAllocationCounters()
+{
+	thread_local AllocationCounters counters;
+	return counters;
+}
+
+// Allocates from the current pool. Each block remembers its pool in a
+// small header, so it may be freed after the current pool has changed.
+inline void* PoolAllocate(size_t size)
+{
+	const size_t Header = MemoryPool::Alignment;
+	MemoryPool* pool = MemoryPool::Current();
+	void* block = pool ? pool->Allocate(size + Header)
+		: ::operator new(size + Header);
+	*(MemoryPool**)block = pool;
+	++GetAllocationCounters().Allocations;
+	return (char*)block + Header;
+}
+inline void PoolDeallocate(void* pointer, size_t size)
+{
+	if (pointer == nullptr) return;
+	const size_t Header = MemoryPool::Alignment;
+	void* block = (char*)pointer - Header;
+	MemoryPool* pool = *(MemoryPool**)block;
+	++GetAllocationCounters().Deallocations;
+	if (pool) pool->Deallocate(block, size + Header);
+	else ::operator delete(block);
+}
+
+template<typename ValueType>
+struct PoolAllocator
+{
+	using value_type = ValueType;
+	PoolAllocator() = default;
+	template<typename OtherType>
+	PoolAllocator(const PoolAllocator<OtherType>&) {}
+	ValueType* allocate(size_t n)
+	{
+		return (ValueType*)PoolAllocate(n * sizeof(ValueType));
+	}
+	void deallocate(ValueType* pointer, size_t n)
+	{
+		PoolDeallocate(pointer, n * sizeof(ValueType));
+	}
+	template<typename OtherType>
+	bool operator==(const PoolAllocator<OtherType>&)const { return true; }
+	template<typename OtherType>
+	bool operator!=(const PoolAllocator<OtherType>&)const { return false; }
 };
 
+// Takes ownership of object; the control block comes from the current pool.
+template<typename ValueType>
+Container<ValueType> ToContainer(ValueType* object)
+{
+	return Container<ValueType>(object, std::default_delete<ValueType>(),
+		PoolAllocator<ValueType>());
+}
+// Object and control block in a single pool allocation.
+template<typename ValueType, typename... Args>
+Container<ValueType> MakeContainer(Args&&... args)
+{
+	return std::allocate_shared<ValueType>(PoolAllocator<ValueType>(),
+		std::forward<Args>(args)...);
+}
+
 struct ICloneable
 {
 	ICloneable() = default;
 	virtual ~ICloneable() = default;
 	virtual ICloneable* Clone()const = 0;
+	// Every clone in the hierarchy is allocated from the current pool.
+	static void* operator new(size_t size) { return PoolAllocate(size); }
+	static void operator delete(void* pointer, size_t size)
+	{
+		PoolDeallocate(pointer, size);
+	}
 };
 
 struct IState : public ICloneable
@@ -88,29 +382,29 @@ class GameObject : public ICloneable, public INamable
 public:
 	GameObject() = default;
 	GameObject(const GameObject& other) :
-		State(other.State->Clone()),
+		State(ToContainer<IState>(other.State->Clone())),
 		Attribute(other.Attribute)
 	{
-		SetName(Attribute->GetName());
+		SetName(Attribute->GetNameId());
 	}
 	GameObject(GameObject&& other)noexcept :
 		State(other.State),
 		Attribute(other.Attribute)
 	{
-		SetName(Attribute->GetName());
+		SetName(Attribute->GetNameId());
 	}
 	GameObject& operator=(const GameObject& other)
 	{
-		State = Container<IState>(other.State->Clone());
+		State = ToContainer<IState>(other.State->Clone());
 		Attribute = other.Attribute;
-		SetName(Attribute->GetName());
+		SetName(Attribute->GetNameId());
 		return *this;
 	}
 	GameObject& operator=(GameObject&& other)noexcept
 	{
 		State = other.State;
 		Attribute = other.Attribute;
-		SetName(Attribute->GetName());
+		SetName(Attribute->GetNameId());
 		return *this;
 	}
 	virtual ~GameObject() = default;
@@ -129,38 +423,45 @@ public:
 	}
 	Container<IState> GetStateCopy()const
 	{
-		return Container<IState>(State->Clone());
+		return ToContainer<IState>(State->Clone());
 	}
 	Container<IAttribute> GetAttributeCopy()const
 	{
-		return Container<IAttribute>(Attribute->Clone());
+		return ToContainer<IAttribute>(Attribute->Clone());
 	}
 	const IState* GetState()const { return State.get(); }
 	IState* GetState() { return State.get(); }
 protected:
+	// The attribute is shared by copies of this object, so it is only
+	// reachable as const.
 	const IAttribute* GetAttribute()const { return Attribute.get(); }
-	IAttribute* GetAttribute() { return Attribute.get(); }
+	const Container<const IAttribute>& GetSharedAttribute()const { return Attribute; }
 	void SetState(IState* state)
 	{
-		State = Container<IState>(state->Clone());
+		State = ToContainer<IState>(state->Clone());
+	}
+	// Takes ownership of state instead of copying it
+	void AdoptState(IState* state)
+	{
+		State = ToContainer(state);
 	}
 	template<typename StateType>
 	void SetState(Container<StateType> state)
 	{
-		State = Container<IState>(state->Clone());
+		State = ToContainer<IState>(state->Clone());
 	}
-	void SetAttribute(IAttribute* attribute)
+	void SetAttribute(const IAttribute* attribute)
 	{
-		Attribute = Container<IAttribute>(attribute->Clone());
+		Attribute = ToContainer<IAttribute>(attribute->Clone());
 	}
 	template<typename AttributeType>
 	void SetAttribute(Container<AttributeType> attribute)
 	{
-		Attribute = Container<IAttribute>(attribute);
+		Attribute = Container<const IAttribute>(attribute);
 	}
 private:
 	Container<IState> State = nullptr;
-	Container<IAttribute> Attribute = nullptr;
+	Container<const IAttribute> Attribute = nullptr;
 };
 
 struct IModifier : public ICloneable, public INamable
@@ -169,8 +470,13 @@ struct IModifier : public ICloneable, public INamable
 	virtual ~IModifier() = default;
 	virtual IModifier* Clone()const = 0;
 	virtual void Modify(IAttribute*)const = 0;
+	// Modifiers returning false are skipped when building the modified
+	// attribute; the owning state applies them itself, e.g. by keeping a
+	// running total in OnModifierAdded/OnModifierRemoved.
+	virtual bool ModifiesAttribute()const { return true; }
 	int RoundCount = 0;
 	int TimeCount = 0;
+	// Lifetime in the owner's actions and in game time; -1 never expires.
 	int MaxRound = -1;
 	int MaxTime = -1;
 };
@@ -179,17 +485,18 @@ class StateBase : public IState
 {
 public:
 	StateBase() = default;
-	StateBase(const StateBase& other) : Modifiers(other.Modifiers.size())
+	StateBase(const StateBase& other) :
+		Data(other.Data ? new ModifierData(*other.Data) : nullptr)
 	{
-		for (size_t i = 0; i < other.Modifiers.size(); ++i)
-			Modifiers[i] = Container<IModifier>(other.Modifiers[i]->Clone());
+		if (Data)
+			for (auto& modifier : Data->Modifiers)
+				modifier = ToContainer<IModifier>(modifier->Clone());
 	}
 	StateBase(StateBase&& other) = default;
 	StateBase& operator=(const StateBase& other)
 	{
-		Modifiers.resize(other.Modifiers.size());
-		for (size_t i = 0; i < other.Modifiers.size(); ++i)
-			Modifiers[i] = Container<IModifier>(other.Modifiers[i]->Clone());
+		if (this != &other)
+			StateBase(other).Data.swap(Data);
 		return *this;
 	}
 	StateBase& operator=(StateBase&& other) = default;
@@ -197,25 +504,183 @@ public:
 	virtual StateBase* Clone()const { return new StateBase(*this); }
 	void RemoveModifier(const string& name)
 	{
-		auto iter = remove_if(Modifiers.begin(), Modifiers.end(),
-			[&](Container<IModifier> modifier)
-			{ return modifier->HasName(name); });
-		Modifiers.erase(iter, Modifiers.end());
+		Symbol id;
+		if (Data == nullptr || !SymbolTable::Global().TryFind(name, id))
+			return;
+		auto& modifiers = Data->Modifiers;
+		auto& ids = Data->Ids;
+		size_t kept = 0;
+		for (size_t i = 0; i < modifiers.size(); ++i)
+		{
+			if (modifiers[i]->HasName(id))
+			{
+				NoteRemoved(*modifiers[i]);
+				continue;
+			}
+			modifiers[kept] = move(modifiers[i]);
+			ids[kept++] = ids[i];
+		}
+		if (kept == modifiers.size())
+			return;
+		modifiers.resize(kept);
+		ids.resize(kept);
+		++Data->Version;
+		OnModifiersChanged();
+	}
+	// Removes the modifier with the id returned by AddModifier; returns
+	// false if it has already been removed.
+	bool RemoveModifier(size_t id)
+	{
+		if (Data == nullptr)
+			return false;
+		auto& ids = Data->Ids;
+		// Ids are handed out in increasing order, so the list stays sorted.
+		auto iter = std::lower_bound(ids.begin(), ids.end(), id);
+		if (iter == ids.end() || *iter != id)
+			return false;
+		auto modifier = Data->Modifiers.begin() + (iter - ids.begin());
+		NoteRemoved(**modifier);
+		Data->Modifiers.erase(modifier);
+		ids.erase(iter);
+		++Data->Version;
+		OnModifiersChanged();
+		return true;
+	}
+	// Changes whenever the modifier list changes; used to validate caches.
+	size_t GetModifierVersion()const { return Data ? Data->Version : 0; }
+	size_t GetModifierCount()const { return Data ? Data->Modifiers.size() : 0; }
+	// The same, counting only modifiers that change the attribute.
+	size_t GetAttributeVersion()const { return Data ? Data->AttributeVersion : 0; }
+	size_t GetAttributeModifierCount()const
+	{
+		return Data ? Data->AttributeModifierCount : 0;
+	}
+	// Deep copies of the modifier list, e.g. for saving a snapshot.
+	List<Container<IModifier>> CloneModifiers()const
+	{
+		List<Container<IModifier>> result(GetModifierCount());
+		for (size_t i = 0; i < result.size(); ++i)
+			result[i] = ToContainer<IModifier>(Data->Modifiers[i]->Clone());
+		return result;
+	}
+	const List<size_t>& GetModifierIds()const
+	{
+		static const List<size_t> None;
+		return Data ? Data->Ids : None;
+	}
+	// Replaces the modifier list with copies of modifiers, keeping their
+	// ids. Unlike AddModifier, ModifyState is not applied again.
+	void SetModifiers(const List<Container<IModifier>>& modifiers,
+		const List<size_t>& ids)
+	{
+		if (modifiers.size() != ids.size())
+			throw InvalidArgumentException("each modifier needs an id.");
+		if (Data == nullptr)
+		{
+			if (modifiers.empty())
+				return;
+			Data.reset(new ModifierData());
+		}
+		for (auto& modifier : Data->Modifiers)
+			NoteRemoved(*modifier);
+		Data->Modifiers.resize(modifiers.size());
+		for (size_t i = 0; i < modifiers.size(); ++i)
+		{
+			Data->Modifiers[i] = ToContainer<IModifier>(modifiers[i]->Clone());
+			Data->NextId = max(Data->NextId, ids[i] + 1);
+			NoteAdded(*Data->Modifiers[i]);
+		}
+		Data->Ids = ids;
+		++Data->Version;
+		OnModifiersChanged();
 	}
 protected:
 	IAttribute* GetModifiedAttribute(const IAttribute* attribute)const
 	{ // Tips: You need release the resource of the return pointer
 		auto result = attribute->Clone();
-		for (auto& modifier : Modifiers)
-			modifier->Modify(result);
+		if (Data)
+			for (auto& modifier : Data->Modifiers)
+				if (modifier->ModifiesAttribute())
+					modifier->Modify(result);
 		return result;
 	}
-	void AddModifier(const IModifier* modifier)
+	// The same, cached until the source attribute or the attribute
+	// modifiers change; copies of the state share the cache. Without such
+	// modifiers it is attribute itself, so no copy is made.
+	const Container<const IAttribute>&
+	GetModifiedAttribute(const Container<const IAttribute>& attribute)const
+	{
+		if (GetAttributeModifierCount() == 0)
+			return attribute;
+		if (Data->ModifiedAttribute == nullptr
+			|| Data->ModifiedSource != attribute.get()
+			|| Data->ModifiedVersion != Data->AttributeVersion)
+		{
+			Data->ModifiedAttribute =
+				ToContainer<IAttribute>(GetModifiedAttribute(attribute.get()));
+			Data->ModifiedSource = attribute.get();
+			Data->ModifiedVersion = Data->AttributeVersion;
+		}
+		return Data->ModifiedAttribute;
+	}
+	size_t AddModifier(const IModifier* modifier)
+	{
+		if (Data == nullptr)
+			Data.reset(new ModifierData());
+		Data->Modifiers.push_back(ToContainer<IModifier>(modifier->Clone()));
+		NoteAdded(*Data->Modifiers.back());
+		Data->Ids.push_back(Data->NextId);
+		++Data->Version;
+		OnModifiersChanged();
+		return Data->NextId++;
+	}
+	virtual void OnModifiersChanged() {}
+	// Called for each modifier entering or leaving the list, before
+	// OnModifiersChanged.
+	virtual void OnModifierAdded(const IModifier&) {}
+	virtual void OnModifierRemoved(const IModifier&) {}
+private:
+	// Most states never get a modifier, so everything about modifiers is
+	// kept out of line and allocated (from the current pool) with the
+	// first one. It is kept once allocated, so ids keep increasing.
+	struct ModifierData
+	{
+		List<Container<IModifier>> Modifiers;
+		List<size_t> Ids;
+		size_t NextId = 0;
+		size_t Version = 0;
+		size_t AttributeModifierCount = 0;
+		size_t AttributeVersion = 0;
+		Container<const IAttribute> ModifiedAttribute = nullptr;
+		const IAttribute* ModifiedSource = nullptr;
+		size_t ModifiedVersion = 0;
+		static void* operator new(size_t size) { return PoolAllocate(size); }
+		static void operator delete(void* pointer, size_t size)
+		{
+			PoolDeallocate(pointer, size);
+		}
+	};
+	void NoteAdded(const IModifier& modifier)
+	{
+		if (modifier.ModifiesAttribute())
+		{
+			++Data->AttributeModifierCount;
+			++Data->AttributeVersion;
+		}
+		OnModifierAdded(modifier);
+	}
+	void NoteRemoved(const IModifier& modifier)
 	{
-		Modifiers.push_back(Container<IModifier>(modifier->Clone()));
+		if (modifier.ModifiesAttribute())
+		{
+			// The cached copy is not needed any more
+			if (--Data->AttributeModifierCount == 0)
+				Data->ModifiedAttribute = nullptr;
+			++Data->AttributeVersion;
+		}
+		OnModifierRemoved(modifier);
 	}
-private:
-	List<Container<IModifier>> Modifiers;
+	mutable std::unique_ptr<ModifierData> Data;
 };
 
 struct EntityAttribute;
@@ -238,14 +703,19 @@ struct EntityState : public StateBase
 	EntityState() = default;
 	virtual EntityState* Clone()const { return new EntityState(*this); }
 	virtual ~EntityState() = default;
-	Container<EntityAttribute>
-	GetModifiedAttribute(const EntityAttribute* attribute)const;
-	void AddModifier(const EntityAttributeModifier* modifier)
+	// The attribute with all attribute modifiers applied; see
+	// StateBase::GetModifiedAttribute. Treat it as read-only.
+	const Container<const IAttribute>&
+	GetModifiedAttribute(const Container<const IAttribute>& attribute)const
+	{
+		return StateBase::GetModifiedAttribute(attribute);
+	}
+	size_t AddModifier(const EntityAttributeModifier* modifier)
 	{
 		if (modifier == nullptr)
 			throw NullArgumentException("modifier can\'t be null.");
 		modifier->ModifyState(this);
-		StateBase::AddModifier((const IModifier*)modifier);
+		return StateBase::AddModifier((const IModifier*)modifier);
 	}
 };
 
@@ -270,35 +740,41 @@ struct EntityAttribute : public IAttribute
 	void AddNamedAction(const ActionHandler& handler, const string& name)
 	{
 		AddAction(handler);
-		NamedActions[name] = handler;
+		Symbol id = SymbolTable::Global().Intern(name);
+		for (auto& action : NamedActions)
+			if (action.first == id)
+			{
+				action.second = handler;
+				return;
+			}
+		NamedActions.emplace_back(id, handler);
+	}
+	bool TryInvokeAction(Symbol actionName, Entity* entity)const
+	{
+		for (auto& action : NamedActions)
+			if (action.first == actionName)
+			{
+				action.second(entity);
+				return true;
+			}
+		return false;
 	}
-	bool TryInvokeAction(const string& actionName, Entity* entity)
+	bool TryInvokeAction(const string& actionName, Entity* entity)const
 	{
-		if (NamedActions.count(actionName))
-		{
-			NamedActions[actionName](entity);
-			return true;
-		}
-		return false;
+		Symbol id;
+		return SymbolTable::Global().TryFind(actionName, id)
+			&& TryInvokeAction(id, entity);
 	}
-	void InvokeAllActions(Entity* entity)
+	void InvokeAllActions(Entity* entity)const
 	{
 		for (auto& action : Actions)
 			action(entity);
 	}
 private:
 	List<ActionHandler> Actions;
-	HashMap<string, ActionHandler> NamedActions;
+	List<std::pair<Symbol, ActionHandler>> NamedActions; // few per attribute
 };
 
-inline Container<EntityAttribute>
-EntityState::GetModifiedAttribute(const EntityAttribute* attribute)const
-{
-	auto result =
-		(EntityAttribute*)StateBase::GetModifiedAttribute(attribute);
-	return Container<EntityAttribute>(result);
-}
-
 inline void EntityAttributeModifier::ModifyState(IState* state)const
 {
 	EntityState* pEntityState = dynamic_cast<EntityState*>(state);
@@ -320,81 +796,113 @@ inline void EntityAttributeModifier::Modify(IAttribute* attribute)const
 
 class Entity : public GameObject
 {
-	static HashMap<string, Container<EntityAttribute>> AttributeMap;
-	static HashMap<string, Container<EntityState>> StateMap;
+	// Indexed by the Symbol of the registered name
+	static List<Container<EntityAttribute>> AttributeMap;
+	static List<Container<EntityState>> StateMap;
+	template<typename ValueType>
+	static bool Register(List<Container<ValueType>>& map, ValueType* value,
+		const string& name, bool replaceOld)
+	{
+		Symbol id = SymbolTable::Global().Intern(name);
+		if (map.size() <= id)
+			map.resize(id + 1);
+		if (map[id] != nullptr && !replaceOld)
+			throw InvalidArgumentException("name has been used.");
+		map[id] = ToContainer<ValueType>(value->Clone());
+		return true;
+	}
+	template<typename ValueType>
+	static Container<ValueType> Find(const List<Container<ValueType>>& map,
+		const string& name)
+	{
+		Symbol id;
+		if (!SymbolTable::Global().TryFind(name, id) || id >= map.size())
+			return nullptr;
+		return map[id];
+	}
 public:
 	static bool NamedAttribute(EntityAttribute* attribute, const string& name,
 		bool replaceOld = false)
 	{
 		if (attribute == nullptr)
 			throw NullArgumentException("attribute can\'t be null.");
-		if (AttributeMap.count(name) && !replaceOld)
-			throw InvalidArgumentException("name has been used.");
-		AttributeMap[name] = Container<EntityAttribute>(attribute->Clone());
+		return Register(AttributeMap, attribute, name, replaceOld);
 	}
 	static bool NamedState(EntityState* state, const string& name,
 		bool replaceOld = false)
 	{
 		if (state == nullptr)
 			throw NullArgumentException("state can\'t be null.");
-		if (StateMap.count(name) && !replaceOld)
-			throw InvalidArgumentException("name has been used.");
-		StateMap[name] = Container<EntityState>(state->Clone());
+		return Register(StateMap, state, name, replaceOld);
 	}
-	Entity(EntityAttribute* attribute, EntityState* state) :
-		Entity(Container<EntityAttribute>
+	Entity(const EntityAttribute* attribute, EntityState* state) :
+		Entity(ToContainer<EntityAttribute>
 			(attribute ? attribute->Clone() : nullptr), state) {}
-	Entity(EntityAttribute* attribute, const string& stateName) :
-		Entity(Container<EntityAttribute>
+	Entity(const EntityAttribute* attribute, const string& stateName) :
+		Entity(ToContainer<EntityAttribute>
 			(attribute ? attribute->Clone() : nullptr),
-			 StateMap[stateName].get()) {}
+			 Find(StateMap, stateName).get()) {}
 	Entity(const string& attributeName, EntityState* state) :
-		Entity(AttributeMap[attributeName], state) {}
+		Entity(Find(AttributeMap, attributeName), state) {}
 	Entity(const string& attributeName, const string& stateName) :
-		Entity(AttributeMap[attributeName], StateMap[stateName].get()) {}
+		Entity(Find(AttributeMap, attributeName),
+			Find(StateMap, stateName).get()) {}
+	// Shares attribute with other entities instead of copying it.
+	Entity(Container<const EntityAttribute> attribute, EntityState* state)
+	{
+		if (attribute == nullptr)
+			throw NullArgumentException("attribute can\'t be null.");
+		SetAttribute(attribute);
+		SetName(attribute->GetNameId());
+		if (state == nullptr)
+			AdoptState(attribute->CreateDefaultState());
+		else
+		{
+			SetState(state);
+		}
+	}
 	virtual Entity* Clone()const { return new Entity(*this); }
 	virtual ~Entity() = default;
-	Container<EntityAttribute> GetModifiedAttribute()const
+	// Valid until the modifiers of this entity change.
+	const EntityAttribute* GetModifiedAttribute()const
 	{
-		return ((EntityState*)GetState())
-			->GetModifiedAttribute((EntityAttribute*)GetAttribute());
+		return static_cast<const EntityAttribute*>(((const EntityState*)GetState())
+			->GetModifiedAttribute(GetSharedAttribute()).get());
 	}
-	void AddModifier(EntityAttributeModifier* modifier)
+	// Keeps the modified attribute alive when the modifiers change.
+	Container<const EntityAttribute> GetSharedModifiedAttribute()const
 	{
-		((EntityState*)GetState())->AddModifier(modifier);
+		return std::static_pointer_cast<const EntityAttribute>(
+			((const EntityState*)GetState())
+				->GetModifiedAttribute(GetSharedAttribute()));
+	}
+	size_t AddModifier(EntityAttributeModifier* modifier)
+	{
+		return ((EntityState*)GetState())->AddModifier(modifier);
 	}
 	void RemoveModifier(const string& name)
 	{
 		((EntityState*)GetState())->RemoveModifier(name);
 	}
+	bool RemoveModifier(size_t id)
+	{
+		return ((EntityState*)GetState())->RemoveModifier(id);
+	}
 	void DoActions()
 	{
-		((EntityAttribute*)GetAttribute())->InvokeAllActions(this);
+		((const EntityAttribute*)GetAttribute())->InvokeAllActions(this);
 	}
 	bool TryDoAction(const string& actionName)
 	{
-		return ((EntityAttribute*)GetAttribute())->TryInvokeAction(actionName, this);
+		return ((const EntityAttribute*)GetAttribute())->TryInvokeAction(actionName, this);
 	}
-protected:
-	Entity(Container<EntityAttribute> attribute, EntityState* state)
+	bool TryDoAction(Symbol actionName)
 	{
-		if (attribute == nullptr)
-			throw NullArgumentException("attribute can\'t be null.");
-		SetAttribute(attribute);
-		if (state == nullptr)
-		{
-			state = attribute->CreateDefaultState();
-			SetState(state);
-			delete state;
-		}
-		else
-		{
-			SetState(state);
-		}
+		return ((const EntityAttribute*)GetAttribute())->TryInvokeAction(actionName, this);
 	}
 };
-HashMap<string, Container<EntityAttribute>> Entity::AttributeMap;
-HashMap<string, Container<EntityState>> Entity::StateMap;
+List<Container<EntityAttribute>> Entity::AttributeMap;
+List<Container<EntityState>> Entity::StateMap;
 
 } // namespace GameCore
 